@@ -0,0 +1,51 @@
+#ifndef __BasicSPH_H__
+#define __BasicSPH_H__
+
+#include "SphProcessor.h"
+
+// SPH with the pressure given by the equation of state, from SPH 03'.
+template <typename Real, typename Policy>
+class BasicSPH : public SPHProcessor<Real>
+{
+public:
+	BasicSPH(Rect rect, const SphParameters& params)
+		: SPHProcessor<Real>(rect, params)
+	{}
+
+protected:
+	typedef SPHProcessor<Real> Base;
+	using Base::particles;
+	using Base::calculateDensity;
+	using Base::calculatePressure;
+	using Base::calculateNormalsAndForces;
+	using Base::calculatePressureForce;
+	using Base::calculatePressureForcePairs;
+	using Base::calculateBoundaryForces;
+
+	virtual void calculateForces(double dt) override
+	{
+		Policy policy;
+
+		// The pressure of the equation of state only needs the density of the particle itself.
+		calculateDensity([this](int i) { calculatePressure(i); });
+
+		PhaseTimer timer(PhaseForces);
+		calculateNormalsAndForces(policy);
+
+		if (USE_HALF_PAIR_FORCES)
+		{
+			calculatePressureForcePairs(policy);
+		}
+		else
+		{
+			parallelFor(particles.size(), [&](int i)
+			{
+				calculatePressureForce(i, policy);
+			});
+		}
+
+		calculateBoundaryForces([this](int i) { return particles.pressure[i] * particles.densityInv[i] * particles.densityInv[i]; }, &particles.forcePressure, policy);
+	}
+};
+
+#endif // __BasicSPH_H__
\ No newline at end of file
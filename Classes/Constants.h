@@ -1,8 +1,17 @@
 #ifndef __Constants_H__
 #define __Constants_H__
 
-#define USE_OPENMP
-const int OPENMP_THREAD_COUNT = 4;
+// Task scheduler, see TaskScheduler.
+const int THREAD_COUNT = 0; // Threads of the solver including the calling one, 0 for one per core.
+const int TASK_CHUNK_SIZE = 64; // Particles per task, a compact block of grid cells in the Z-ordered store.
+
+// The constants of the simulation below are the defaults of SphParameters, which can be overridden at runtime from
+// SPH_PARAMETER_FILE. Types and flags that select code paths stay compile-time only.
+
+// Scalar type of the SPH solver. Float halves the memory traffic and doubles the SIMD width of the batched kernels,
+// double is kept for validation.
+typedef float SphReal;
+const bool COMPARE_PRECISION = false; // Also step a solver in the other precision and report the drift between the two.
 
 // Fluid constants
 const double viscosity = 0;
@@ -13,47 +22,59 @@ const double restDensity = 1;
 
 // For Particle
 const double radius = 5;
-const double area = M_PI * radius * radius;
-const double mass = restDensity * area;
 const double range = 4 * radius;
-const double renderRange = range;
-const double halfRangeSq = (range / 2) * (range / 2);
-const double rangeSq = range * range;
-const double range4th = rangeSq * rangeSq;
-const double range6th = range4th * rangeSq;
-const double range8th = range4th * range4th;
-
-// For kernels
-const double p6WConst = 4 / M_PI / rangeSq;
-const double p6WGradientConst = -24 / M_PI / range8th;
-const double p6WLaplacianConst = -48 / M_PI / range8th;
-const double spikyWConst = 10 / M_PI / rangeSq;
-const double spikyWGradientConst = -30 / M_PI / range4th;
-const double visWLaplacianConst = 40 / M_PI / range4th;
-const double cohesionKernelConst = 10000 / range6th;
 
 // Physics world constants
 const double gravity = -200;
 const double speedMultiplier = 1;
+const double wallRestitution = 0.1; // Of the bounds of the headless engine, the same as the restitution of the particle shapes.
 
 // SPH
 const double cXSPH = 0.05;
 const double maxPressureForce = 300000;
 const double boundaryThreshold = 0.03;
+const bool USE_HALF_PAIR_FORCES = true; // Evaluate antisymmetric pair forces once per pair and apply them to both particles.
 
 // Basic SPH
 const int substep = 1;
 
+// Adaptive substeps, see SPHProcessor::chooseSubStepCount(). The substep counts of the solvers are the least substeps.
+const double CFL_NUMBER = 0.4; // Kernel ranges the fastest particle may move in a substep, 0 for fixed substeps.
+const double FORCE_NUMBER = 0.3;
+const int MAX_SUBSTEP_COUNT = 8;
+
 // PCISPH
-const int MAX_PCISPH_ITERATION = 5;
+const int MIN_PCISPH_ITERATION = 1;
+const int MAX_PCISPH_ITERATION = 8;
 const double MAX_PCISPH_ERROR_RATE = 0.2;
-const double DELTA = 50000; // Here in contrast to PCISPH we define delta as a parameter so we can tune for better stability.
+const double AVG_PCISPH_ERROR_RATE = 0.02;
+const double DELTA = 0; // Computed from a prototype particle with a full neighborhood. A positive value overrides it.
+const double DELTA_SCALE = 0.4; // The prototype delta is stiffer than the fluid tolerates at one substep per frame.
 const int PCISPH_SUBSTEP_COUNT = 1;
 
+// DFSPH
+const int MAX_DFSPH_ITERATION = 10;
+const int MAX_DFSPH_DIVERGENCE_ITERATION = 5;
+const double AVG_DFSPH_ERROR_RATE = 0.01;
+const double AVG_DFSPH_DIVERGENCE_ERROR_RATE = 0.02; // Compression the velocity field would cause within a substep.
+const int DFSPH_SUBSTEP_COUNT = 1;
+
+// Double density relaxation, viscosity and surface tension in the units of the reference implementation scaled to our
+// range and gravity.
+const double RELAXATION_STIFFNESS = 0.005; // Displacement in ranges per unit of density error.
+const double RELAXATION_NEAR_STIFFNESS = 0.006;
+const double RELAXATION_SURFACE_TENSION = 0.0044;
+const double RELAXATION_LINEAR_VISCOSITY = 0.004;
+const double RELAXATION_QUADRATIC_VISCOSITY = 0.0002;
+const int RELAXATION_ITERATION_COUNT = 3;
+const int RELAXATION_SUBSTEP_COUNT = 1;
+
 enum SolverType
 {
 	BasicSph,
 	PciSph,
+	DfSph,
+	DoubleDensity,
 };
 
 const SolverType solver = PciSph;
@@ -66,4 +87,40 @@ enum SurfaceTensionType
 
 const SurfaceTensionType surfaceTensionType = CohesionAndCurvature;
 
+// Kernel family of the pressure gradient.
+enum PressureKernelType
+{
+	SpikyKernel,
+	Poly6Kernel,
+};
+
+const PressureKernelType pressureKernel = SpikyKernel;
+
+// How SphConstraint couples the particles to chipmunk. With BodyCoupling every particle is a chipmunk body, with
+// NativeCoupling the particles only live in the SPH store and collide against the chipmunk shapes.
+enum ParticleCoupling
+{
+	BodyCoupling,
+	NativeCoupling,
+};
+
+const ParticleCoupling particleCoupling = NativeCoupling;
+
+// Boundary particles, see RigidBoundary.
+const double BOUNDARY_SPACING = 0.5; // Spacing of the samples along the rigid body outlines, relative to the rest spacing of the fluid.
+
+// Spatial grid
+enum GridType
+{
+	LinkedListGrid, // Every cell is a std::list of particle indices.
+	CountingSortGrid, // Particle indices sorted by cell into one array, with a start offset per cell.
+	HashedGrid, // Like CountingSortGrid for the occupied cells only, found through a hash table. Not bound to the grid rect.
+};
+
+const GridType gridType = CountingSortGrid;
+const double VERLET_SKIN = 0.25 * range; // Extra neighbor search range kept in Verlet lists, 0 to search the grid every substep.
+const int MORTON_REORDER_INTERVAL = 60; // Substeps between sorting the particle store in Z-order of the grid cells, 0 to disable.
+const int GRID_REBUILD_INTERVAL = 30; // Grid updates between full rebuilds, the others only move the particles that changed their cell. 0 to always rebuild.
+const double GRID_MAX_MOVED_FRACTION = 0.1; // Share of the particles away from their cell of the last full rebuild that triggers an early rebuild.
+
 #endif // __Constants_H__
\ No newline at end of file
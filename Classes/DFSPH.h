@@ -0,0 +1,246 @@
+#ifndef __DFSPH_H__
+#define __DFSPH_H__
+
+#include "SphProcessor.h"
+
+// Divergence-free SPH, from "Divergence-Free Smoothed Particle Hydrodynamics" (Bender and Koschier 2015). Two pressure
+// solves correct the velocities instead of the positions: one makes the velocity field divergence-free, the other removes
+// the compression the predicted velocities would cause. The stiffness of every particle comes from its own neighborhood,
+// so there is no delta to tune and much larger substeps stay stable than with PCISPH.
+template <typename Real, typename Policy>
+class DFSPH : public SPHProcessor<Real>
+{
+public:
+	DFSPH(Rect rect, const SphParameters& params)
+		: SPHProcessor<Real>(rect, params)
+	{}
+
+	virtual int getSubStepCount() override
+	{
+		return params.dfsphSubstepCount;
+	}
+
+protected:
+	typedef SPHProcessor<Real> Base;
+	using Base::params;
+	using Base::kernelConstants;
+	using Base::particles;
+	using Base::getDefaultMass;
+	using Base::calculateDensity;
+	using Base::calculateNormalsAndForces;
+	using Base::pressureGradient;
+	using Base::rigidBoundary;
+	using Base::boundaryNeighbors;
+	using Base::calculateBoundaryForces;
+	using Base::getStaticBoundaryGradient;
+
+	std::vector<Real> factors; // 1 / (|sum(m grad W)|^2 + sum(|m grad W|^2)), 0 for particles without neighbors.
+	std::vector<Real> stiffness; // kappa / rho of every particle in the current iteration.
+	std::vector<Real> stiffnessSum; // Over the iterations of the substep, for the forces on the boundary bodies.
+	Vec2Array<Real> predictedVel;
+	Vec2Array<Real> velocityCorrection; // Sum of the corrections of both solves in the current substep.
+
+	virtual void calculateForces(double dt) override
+	{
+		Policy policy;
+		Real mass = (Real)getDefaultMass();
+		int count = particles.size();
+
+		calculateDensity();
+
+		{
+			PhaseTimer timer(PhaseForces);
+			calculateNormalsAndForces(policy);
+		}
+
+		PhaseTimer timer(PhasePressureSolve);
+
+		calculateFactors(mass, policy);
+		predictedVel.assign(particles.vel);
+		velocityCorrection.x.assign(count, 0);
+		velocityCorrection.y.assign(count, 0);
+		stiffnessSum.assign(count, 0);
+
+		// Make the velocity field divergence-free, so the particles do not start compressing.
+		for (int iteration = 0; iteration < params.maxDfsphDivergenceIteration; iteration++)
+		{
+			TelemetryScope iterationScope("divergenceIteration");
+			Telemetry::getInstance().addCounter(CounterDivergenceIterations, 1);
+
+			DensityError<Real> error = calculateStiffness(dt, mass, false, policy);
+			if (error.average <= (Real)params.avgDfsphDivergenceErrorRate)
+				break;
+
+			correctVelocities(dt, mass, policy);
+		}
+
+		// Predict the velocities from the non-pressure forces. Gravity is left to the integrator, but the pressure has to
+		// hold the fluid up against it.
+		Real gravityChange = (Real)(params.gravity * dt);
+		Real dtOverMass = (Real)dt / mass;
+		parallelFor(count, [&](int i)
+		{
+			predictedVel.add(i, (particles.forceSurface.x[i] + particles.forceViscosity.x[i]) * dtOverMass,
+				(particles.forceSurface.y[i] + particles.forceViscosity.y[i]) * dtOverMass + gravityChange);
+		});
+
+		// Remove the compression the predicted velocities would cause.
+		DensityError<Real> error = {};
+		for (int iteration = 0; iteration < params.maxDfsphIteration; iteration++)
+		{
+			TelemetryScope iterationScope("pressureIteration");
+			Telemetry::getInstance().addCounter(CounterPressureIterations, 1);
+
+			error = calculateStiffness(dt, mass, true, policy);
+			if (error.average <= (Real)params.avgDfsphErrorRate)
+				break;
+
+			correctVelocities(dt, mass, policy);
+		}
+
+		Telemetry::getInstance().maxCounter(CounterMaxDensityError, error.max);
+
+		// The boundary part of the corrections is already in velocityCorrection, only the bodies take the forces.
+		calculateBoundaryForces([this](int i) { return stiffnessSum[i]; }, nullptr, policy);
+
+		// Hand the corrections on as the pressure force, calculateVelocityChanges() turns it back into velocity.
+		Real massOverDt = mass / (Real)dt;
+		parallelFor(count, [&](int i)
+		{
+			particles.forcePressure.set(i, velocityCorrection.x[i] * massOverDt, velocityCorrection.y[i] * massOverDt);
+		});
+	}
+
+	void calculateFactors(Real mass, const Policy& policy)
+	{
+		factors.resize(particles.size());
+
+		parallelFor(particles.size(), [&](int i)
+		{
+			Real sumX = 0;
+			Real sumY = 0;
+			Real sumSq = 0;
+			for (auto& n : particles.neighbors[i])
+			{
+				Real c = mass * pressureGradient(n, kernelConstants, policy);
+				sumX += c * n.rx;
+				sumY += c * n.ry;
+				sumSq += c * c * n.rLenSq;
+			}
+
+			// The boundary only adds to the gradient sum, it does not move with the pressure.
+			Real gradX, gradY;
+			if (getStaticBoundaryGradient(i, gradX, gradY))
+			{
+				sumX += gradX;
+				sumY += gradY;
+			}
+			if (rigidBoundary.size() > 0)
+			{
+				for (auto& n : boundaryNeighbors[i])
+				{
+					Real c = rigidBoundary.psi[n.j] * pressureGradient(n, kernelConstants, policy);
+					sumX += c * n.rx;
+					sumY += c * n.ry;
+				}
+			}
+
+			Real denominator = sumX * sumX + sumY * sumY + sumSq;
+			factors[i] = denominator > 0 ? 1 / denominator : 0;
+		});
+	}
+
+	// Sets the stiffness that removes the compression of every particle within the substep, from its density change rate
+	// at the predicted velocities, plus its current compression when withDensity is set. Expanding particles get no
+	// stiffness, the fluid only pushes. Returns the compression relative to the rest density.
+	DensityError<Real> calculateStiffness(double dt, Real mass, bool withDensity, const Policy& policy)
+	{
+		stiffness.resize(particles.size());
+		Real restDensity = particles.restDensity;
+		Real dtSqInv = (Real)(1 / (dt * dt));
+		DensityErrorSum<Real> none = {};
+
+		DensityErrorSum<Real> errors = parallelReduce(particles.size(), none, [&](int begin, int end, DensityErrorSum<Real>& chunkErrors)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				Real densityChange = 0;
+				for (auto& n : particles.neighbors[i])
+				{
+					Real c = pressureGradient(n, kernelConstants, policy);
+					densityChange += c * ((predictedVel.x[i] - predictedVel.x[n.j]) * n.rx + (predictedVel.y[i] - predictedVel.y[n.j]) * n.ry);
+				}
+
+				Real gradX, gradY;
+				if (getStaticBoundaryGradient(i, gradX, gradY))
+				{
+					densityChange += (predictedVel.x[i] * gradX + predictedVel.y[i] * gradY) / mass;
+				}
+				if (rigidBoundary.size() > 0)
+				{
+					const Vec2Array<Real>& sampleVel = rigidBoundary.samples.vel;
+					for (auto& n : boundaryNeighbors[i])
+					{
+						Real c = rigidBoundary.psi[n.j] / mass * pressureGradient(n, kernelConstants, policy);
+						densityChange += c * ((predictedVel.x[i] - sampleVel.x[n.j]) * n.rx + (predictedVel.y[i] - sampleVel.y[n.j]) * n.ry);
+					}
+				}
+
+				Real compression = densityChange * mass * (Real)dt;
+				if (withDensity)
+				{
+					compression += particles.density[i] - restDensity;
+				}
+				compression = std::max(compression, (Real)0);
+
+				stiffness[i] = compression * factors[i] * dtSqInv;
+				chunkErrors.add(compression / restDensity);
+			}
+		}, [](DensityErrorSum<Real>& errors, const DensityErrorSum<Real>& chunkErrors) { errors.add(chunkErrors); });
+
+		return errors.getError(particles.size());
+	}
+
+	// Applies the pressure accelerations of the current stiffness to the predicted velocities. Every particle only reads the
+	// stiffness of its neighbors, so the particles are updated independently.
+	void correctVelocities(double dt, Real mass, const Policy& policy)
+	{
+		Real scale = -(Real)dt * mass;
+
+		parallelFor(particles.size(), [&](int i)
+		{
+			Real dvx = 0;
+			Real dvy = 0;
+			for (auto& n : particles.neighbors[i])
+			{
+				Real c = (stiffness[i] + stiffness[n.j]) * pressureGradient(n, kernelConstants, policy);
+				dvx += c * n.rx;
+				dvy += c * n.ry;
+			}
+
+			Real gradX, gradY;
+			if (getStaticBoundaryGradient(i, gradX, gradY))
+			{
+				dvx += stiffness[i] / mass * gradX;
+				dvy += stiffness[i] / mass * gradY;
+			}
+			if (rigidBoundary.size() > 0)
+			{
+				for (auto& n : boundaryNeighbors[i])
+				{
+					Real c = rigidBoundary.psi[n.j] / mass * stiffness[i] * pressureGradient(n, kernelConstants, policy);
+					dvx += c * n.rx;
+					dvy += c * n.ry;
+				}
+			}
+			stiffnessSum[i] += stiffness[i];
+
+			dvx *= scale;
+			dvy *= scale;
+			predictedVel.add(i, dvx, dvy);
+			velocityCorrection.add(i, dvx, dvy);
+		});
+	}
+};
+
+#endif // __DFSPH_H__
\ No newline at end of file
@@ -0,0 +1,89 @@
+#ifndef __DistanceField_H__
+#define __DistanceField_H__
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "math/CCGeometry.h"
+#include "TaskScheduler.h"
+
+USING_NS_CC;
+
+// Signed distance to the static geometry, sampled on the nodes of a regular grid together with the density the geometry
+// adds to a particle at that distance. Both are interpolated bilinearly in between, so a lookup costs the same however
+// complex the geometry is. The distance is negative inside the geometry.
+template <typename Real>
+class DistanceField
+{
+public:
+	bool isEmpty() const
+	{
+		return distances.empty();
+	}
+
+	// Samples distance(x, y) at every node of a grid of cellSize over rect, and density(d) of the distance d found there.
+	template <typename Distance, typename Density>
+	void build(Rect rect, double cellSize, Distance distance, Density density)
+	{
+		xl = rect.getMinX();
+		yl = rect.getMinY();
+		this->cellSize = cellSize;
+		cellSizeInv = 1 / cellSize;
+		xCount = (int)std::ceil(rect.size.width / cellSize) + 1;
+		yCount = (int)std::ceil(rect.size.height / cellSize) + 1;
+		distances.resize(xCount * yCount);
+		densities.resize(xCount * yCount);
+
+		// One column per task, a column already is a lot of distance queries.
+		TaskScheduler::getInstance().parallelFor(xCount, 1, [&](int x, int)
+		{
+			for (int y = 0; y < yCount; y++)
+			{
+				double d = distance(xl + x * cellSize, yl + y * cellSize);
+				distances[x * yCount + y] = (Real)d;
+				densities[x * yCount + y] = (Real)density(d);
+			}
+		});
+	}
+
+	// Distance at (px, py) and its gradient, which points away from the geometry.
+	Real sampleDistance(Real px, Real py, Real& gradX, Real& gradY) const
+	{
+		return sample(distances, px, py, gradX, gradY);
+	}
+
+	// Density of the geometry at (px, py) and its gradient.
+	Real sampleDensity(Real px, Real py, Real& gradX, Real& gradY) const
+	{
+		return sample(densities, px, py, gradX, gradY);
+	}
+
+protected:
+	double xl = 0, yl = 0, cellSize = 1, cellSizeInv = 1;
+	int xCount = 0, yCount = 0;
+	std::vector<Real> distances;
+	std::vector<Real> densities;
+
+	// Bilinear interpolation of the node values, clamped to the grid.
+	Real sample(const std::vector<Real>& values, Real px, Real py, Real& gradX, Real& gradY) const
+	{
+		Real fx = std::min(std::max((Real)((px - xl) * cellSizeInv), (Real)0), (Real)(xCount - 1));
+		Real fy = std::min(std::max((Real)((py - yl) * cellSizeInv), (Real)0), (Real)(yCount - 1));
+		int x = std::min((int)fx, xCount - 2);
+		int y = std::min((int)fy, yCount - 2);
+		Real tx = fx - x;
+		Real ty = fy - y;
+
+		const Real* column = &values[x * yCount + y];
+		Real v00 = column[0], v01 = column[1];
+		Real v10 = column[yCount], v11 = column[yCount + 1];
+		Real v0 = v00 + (v01 - v00) * ty;
+		Real v1 = v10 + (v11 - v10) * ty;
+
+		gradX = (v1 - v0) * (Real)cellSizeInv;
+		gradY = ((v01 - v00) + (v11 - v01 - v10 + v00) * tx) * (Real)cellSizeInv;
+		return v0 + (v1 - v0) * tx;
+	}
+};
+
+#endif // __DistanceField_H__
\ No newline at end of file
@@ -0,0 +1,219 @@
+#ifndef __DoubleDensityRelaxation_H__
+#define __DoubleDensityRelaxation_H__
+
+#include "SphProcessor.h"
+
+// Position-based fluid by double density relaxation, from "Particle-based Viscoelastic Fluid Simulation" (Clavet et al.
+// 2005) after the implementation of Tom Madams. The particles are advanced, then moved apart by a pressure and a near
+// pressure computed at the advanced positions, and their velocities are taken from the distance they moved.
+//
+// In contrast to the reference the pressure displacements are not scaled by dt^2, the stiffness is a fraction of the range
+// per unit of density error, so the gain of a relaxation does not depend on the substep.
+//
+// As in the reference, every particle moves by its own share of each pair displacement and writes to its own slot of
+// relaxedPos, and the positions are only replaced once all particles are relaxed. This Jacobi step reads no position
+// another particle writes, so the particles are relaxed in parallel without races.
+template <typename Real, typename Policy>
+class DoubleDensityRelaxation : public SPHProcessor<Real>
+{
+public:
+	DoubleDensityRelaxation(Rect rect, const SphParameters& params)
+		: SPHProcessor<Real>(rect, params)
+		, norm(20 / (2 * M_PI))
+		, nearNorm(30 / (2 * M_PI))
+	{
+		relaxationRestDensity = calculateRestDensity();
+	}
+
+	virtual int getSubStepCount() override
+	{
+		return params.relaxationSubstepCount;
+	}
+
+protected:
+	typedef SPHProcessor<Real> Base;
+	using Base::params;
+	using Base::kernelConstants;
+	using Base::particles;
+	using Base::bounds;
+	using Base::getDefaultMass;
+	using Base::calculateDensity;
+
+	// The relaxation densities sum (1 - q)^3 and (1 - q)^4 over the neighbors, scaled by these, and are independent of
+	// the particle mass and the range.
+	const double norm, nearNorm;
+	double relaxationRestDensity;
+	std::vector<Real> nearPressure;
+	Vec2Array<Real> relaxedPos;
+
+	// The relaxation density of a particle with a full neighborhood, on a lattice of the rest spacing of the particles.
+	double calculateRestDensity() const
+	{
+		double spacing = sqrt(params.getArea());
+		double range = kernelConstants.range;
+		int steps = (int)(range / spacing);
+		double density = 0;
+		for (int x = -steps; x <= steps; x++)
+		{
+			for (int y = -steps; y <= steps; y++)
+			{
+				double r = sqrt((double)(x * x + y * y)) * spacing;
+				if ((x != 0 || y != 0) && r < range)
+				{
+					double a = 1 - r / range;
+					density += a * a * a;
+				}
+			}
+		}
+
+		return density * norm;
+	}
+
+	virtual void calculateForces(double dt) override
+	{
+		int count = particles.size();
+		Real mass = (Real)getDefaultMass();
+		Real gravityChange = (Real)(params.gravity * dt);
+
+		// Only for the renderer and the telemetry, the relaxation has densities of its own.
+		calculateDensity();
+
+		PhaseTimer timer(PhasePressureSolve);
+
+		// Advance the particles with their velocities and gravity.
+		parallelFor(count, [&](int i)
+		{
+			particles.predictedPos.set(i, particles.pos.x[i] + (Real)dt * particles.vel.x[i],
+				particles.pos.y[i] + (Real)dt * (particles.vel.y[i] + gravityChange));
+		});
+
+		// Relax in Jacobi iterations, each one from the positions the last one relaxed to. Surface tension and viscosity
+		// only act once per substep.
+		for (int iteration = 0; iteration < params.relaxationIterationCount; iteration++)
+		{
+			TelemetryScope iterationScope("relaxationIteration");
+			Telemetry::getInstance().addCounter(CounterPressureIterations, 1);
+
+			if (iteration > 0)
+			{
+				particles.predictedPos.x.swap(relaxedPos.x);
+				particles.predictedPos.y.swap(relaxedPos.y);
+			}
+			calculatePressure();
+			calculateRelaxedPositions(dt, iteration == 0);
+		}
+
+		// Hand the velocity the particles moved with on as the pressure force. Gravity is left to the integrator.
+		Real massOverDt = mass / (Real)dt;
+		Real dtInv = (Real)(1 / dt);
+		parallelFor(count, [&](int i)
+		{
+			Real vx = (relaxedPos.x[i] - particles.pos.x[i]) * dtInv;
+			Real vy = (relaxedPos.y[i] - particles.pos.y[i]) * dtInv;
+			particles.forcePressure.set(i, (vx - particles.vel.x[i]) * massOverDt, (vy - particles.vel.y[i] - gravityChange) * massOverDt);
+		});
+
+		// Surface tension and viscosity are part of the relaxation.
+		particles.forceSurface.fill(0);
+		particles.forceViscosity.fill(0);
+	}
+
+	// Calculates the pressure and near pressure of every particle from its relaxation densities at the advanced positions.
+	void calculatePressure()
+	{
+		const Vec2Array<Real>& predictedPos = particles.predictedPos;
+		Real rangeInv = (Real)(1 / kernelConstants.range);
+		Real restDensity = (Real)relaxationRestDensity;
+		nearPressure.resize(particles.size());
+
+		Real maxError = parallelReduce(particles.size(), (Real)0, [&](int begin, int end, Real& chunkMaxError)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				Real density = 0;
+				Real nearDensity = 0;
+				for (auto& n : particles.neighbors[i])
+				{
+					Real dx = predictedPos.x[n.j] - predictedPos.x[i];
+					Real dy = predictedPos.y[n.j] - predictedPos.y[i];
+					Real a = 1 - std::sqrt(dx * dx + dy * dy) * rangeInv;
+					if (a > 0)
+					{
+						density += a * a * a;
+						nearDensity += a * a * a * a;
+					}
+				}
+
+				density *= (Real)norm;
+				nearDensity *= (Real)nearNorm;
+				particles.pressure[i] = (Real)params.relaxationStiffness * (density - restDensity);
+				nearPressure[i] = (Real)params.relaxationNearStiffness * nearDensity;
+
+				chunkMaxError = std::max(chunkMaxError, (density - restDensity) / restDensity);
+			}
+		}, [](Real& maxError, Real chunkMaxError) { maxError = std::max(maxError, chunkMaxError); });
+
+		Telemetry::getInstance().maxCounter(CounterMaxDensityError, maxError);
+	}
+
+	void calculateRelaxedPositions(double dt, bool withTensionAndViscosity)
+	{
+		const Vec2Array<Real>& predictedPos = particles.predictedPos;
+		const Vec2Array<Real>& vel = particles.vel;
+		const std::vector<Real>& pressure = particles.pressure;
+		Real range = (Real)kernelConstants.range;
+		Real rangeInv = (Real)(1 / kernelConstants.range);
+		Real dtSq = (Real)(dt * dt);
+		Real surfaceTension = (Real)(params.relaxationSurfaceTension * norm);
+		Real linearViscosity = (Real)params.relaxationLinearViscosity;
+		Real quadraticViscosity = (Real)params.relaxationQuadraticViscosity;
+		Real xl = bounds.getMinX(), xh = bounds.getMaxX(), yl = bounds.getMinY(), yh = bounds.getMaxY();
+		relaxedPos.x.resize(particles.size());
+		relaxedPos.y.resize(particles.size());
+
+		parallelFor(particles.size(), [&](int i)
+		{
+			Real x = predictedPos.x[i];
+			Real y = predictedPos.y[i];
+
+			for (auto& n : particles.neighbors[i])
+			{
+				Real dx = predictedPos.x[n.j] - predictedPos.x[i];
+				Real dy = predictedPos.y[n.j] - predictedPos.y[i];
+				Real r = std::sqrt(dx * dx + dy * dy);
+				Real a = 1 - r * rangeInv;
+				if (a <= 0 || r == 0)
+					continue;
+
+				// Relax, half of the pair displacement moves particle i.
+				Real d = range * ((nearPressure[i] + nearPressure[n.j]) * a * a * a * (Real)nearNorm + (pressure[i] + pressure[n.j]) * a * a * (Real)norm) / 2;
+				x -= d * dx / r;
+				y -= d * dy / r;
+
+				if (!withTensionAndViscosity)
+					continue;
+
+				// Surface tension.
+				x += surfaceTension * a * a * dx;
+				y += surfaceTension * a * a * dy;
+
+				// Viscosity, only between approaching particles.
+				Real u = (vel.x[i] - vel.x[n.j]) * dx + (vel.y[i] - vel.y[n.j]) * dy;
+				if (u > 0)
+				{
+					u /= r;
+					Real impulse = (Real)0.5 * dtSq * a * (linearViscosity * u + quadraticViscosity * u * u);
+					x -= impulse * dx;
+					y -= impulse * dy;
+				}
+			}
+
+			// Keep the particles inside the bounds, like the wall collisions of the reference.
+			x = std::min(std::max(x, xl), xh);
+			y = std::min(std::max(y, yl), yh);
+			relaxedPos.set(i, x, y);
+		});
+	}
+};
+
+#endif // __DoubleDensityRelaxation_H__
\ No newline at end of file
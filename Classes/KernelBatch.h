@@ -0,0 +1,628 @@
+#ifndef __KernelBatch_H__
+#define __KernelBatch_H__
+
+#include <algorithm>
+#include "Constants.h"
+#include "Particle.h"
+#include "KernelFunctions.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define KERNEL_BATCH_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(KERNEL_BATCH_X86) && defined(__GNUC__)
+#define KERNEL_TARGET_SSE2 __attribute__((target("sse2")))
+#define KERNEL_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define KERNEL_TARGET_SSE2
+#define KERNEL_TARGET_AVX2
+#endif
+
+// Batched versions of the kernels in KernelFunctions.h. They evaluate a whole block of neighbors at once, taking the
+// constants of the smoothing range and arrays of squared distances rLenSq and normalized distances q = |r| / range.
+// Gradient kernels return the scalar c of grad W(r) = c * r. Every kernel has a scalar, an SSE2 and an AVX2
+// implementation in float and double precision; getKernelBatchFunctions<Real>() picks the widest one the CPU supports.
+
+const int KERNEL_BATCH_SIZE = 16;
+
+template <typename Real>
+struct KernelBatchFunctions
+{
+	typedef void (*Func)(const KernelConstants& kc, const Real* rLenSq, const Real* q, int count, Real* out);
+
+	const char* name;
+	Func wFuncP6;
+	Func wGradientFuncP6;
+	Func wLaplacianFuncP6;
+	Func wGradientFuncSpiky;
+	Func wLaplacianFunc;
+	Func surfaceTensionCohesionKernel;
+};
+
+// The cached distances of a block of neighbors, copied into arrays the batched kernels can load with vector instructions.
+template <typename Real>
+struct NeighborBatch
+{
+	const Neighbor<Real>* neighbors;
+	int count;
+	Real rLenSq[KERNEL_BATCH_SIZE];
+	Real q[KERNEL_BATCH_SIZE];
+
+	void load(const Neighbor<Real>* first, int count)
+	{
+		this->neighbors = first;
+		this->count = count;
+		for (int k = 0; k < count; k++)
+		{
+			rLenSq[k] = first[k].rLenSq;
+			q[k] = first[k].q;
+		}
+	}
+};
+
+// Calls visit(first, count) for consecutive blocks of at most KERNEL_BATCH_SIZE neighbors.
+template <typename Real, typename Visit>
+static inline void forEachNeighborBlock(NeighborRange<Real> neighbors, Visit visit)
+{
+	for (const Neighbor<Real>* first = neighbors.begin(); first < neighbors.end(); first += KERNEL_BATCH_SIZE)
+	{
+		visit(first, std::min<int>(KERNEL_BATCH_SIZE, neighbors.end() - first));
+	}
+}
+
+template <typename Real, typename Visit>
+static inline void forEachNeighborBatch(NeighborRange<Real> neighbors, Visit visit)
+{
+	NeighborBatch<Real> batch;
+	forEachNeighborBlock(neighbors, [&](const Neighbor<Real>* first, int count)
+	{
+		batch.load(first, count);
+		visit(batch);
+	});
+}
+
+// Scalar implementations.
+
+template <typename Real>
+static void wFuncP6Scalar(const KernelConstants& kc, const Real* rLenSq, const Real* q, int count, Real* out)
+{
+	for (int k = 0; k < count; k++)
+	{
+		Real t = std::max((Real)0, 1 - rLenSq[k] / (Real)kc.rangeSq);
+		out[k] = (Real)kc.p6WConst * t * t * t;
+	}
+}
+
+template <typename Real>
+static void wGradientFuncP6Scalar(const KernelConstants& kc, const Real* rLenSq, const Real* q, int count, Real* out)
+{
+	for (int k = 0; k < count; k++)
+	{
+		Real t = (Real)kc.rangeSq - rLenSq[k];
+		out[k] = (Real)kc.p6WGradientConst * t * t;
+	}
+}
+
+template <typename Real>
+static void wLaplacianFuncP6Scalar(const KernelConstants& kc, const Real* rLenSq, const Real* q, int count, Real* out)
+{
+	for (int k = 0; k < count; k++)
+	{
+		out[k] = (Real)kc.p6WLaplacianConst * ((Real)kc.rangeSq - rLenSq[k]) * ((Real)kc.rangeSq - 3 * rLenSq[k]);
+	}
+}
+
+template <typename Real>
+static void wGradientFuncSpikyScalar(const KernelConstants& kc, const Real* rLenSq, const Real* q, int count, Real* out)
+{
+	for (int k = 0; k < count; k++)
+	{
+		Real t = 1 - q[k];
+		out[k] = q[k] == 0 ? 0 : (Real)kc.spikyWGradientConst * t * t / q[k];
+	}
+}
+
+template <typename Real>
+static void wLaplacianFuncScalar(const KernelConstants& kc, const Real* rLenSq, const Real* q, int count, Real* out)
+{
+	for (int k = 0; k < count; k++)
+	{
+		out[k] = q[k] == 0 ? 0 : (Real)kc.visWLaplacianConst * (1 - q[k]);
+	}
+}
+
+template <typename Real>
+static void surfaceTensionCohesionKernelScalar(const KernelConstants& kc, const Real* rLenSq, const Real* q, int count, Real* out)
+{
+	for (int k = 0; k < count; k++)
+	{
+		Real t = (Real)kc.range - q[k] * (Real)kc.range;
+		Real w = (Real)kc.cohesionKernelConst * t * t * rLenSq[k];
+		if (rLenSq[k] > (Real)kc.rangeSq)
+			w = 0;
+		else if (rLenSq[k] <= (Real)kc.halfRangeSq)
+			w = 2 * w - (Real)(kc.cohesionKernelConst * kc.range4th / 16);
+		out[k] = w;
+	}
+}
+
+#ifdef KERNEL_BATCH_X86
+
+// SSE2 implementations, two doubles or four floats per instruction.
+
+KERNEL_TARGET_SSE2 static inline __m128d selectSse2(__m128d mask, __m128d a, __m128d b)
+{
+	return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+KERNEL_TARGET_SSE2 static inline void wFuncP6Sse2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m128d one = _mm_set1_pd(1);
+	const __m128d rangeSqInv = _mm_set1_pd(1 / kc.rangeSq);
+	const __m128d c = _mm_set1_pd(kc.p6WConst);
+	int k = 0;
+	for (; k + 2 <= count; k += 2)
+	{
+		__m128d t = _mm_max_pd(_mm_setzero_pd(), _mm_sub_pd(one, _mm_mul_pd(_mm_loadu_pd(rLenSq + k), rangeSqInv)));
+		_mm_storeu_pd(out + k, _mm_mul_pd(c, _mm_mul_pd(t, _mm_mul_pd(t, t))));
+	}
+	wFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void wGradientFuncP6Sse2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m128d h2 = _mm_set1_pd(kc.rangeSq);
+	const __m128d c = _mm_set1_pd(kc.p6WGradientConst);
+	int k = 0;
+	for (; k + 2 <= count; k += 2)
+	{
+		__m128d t = _mm_sub_pd(h2, _mm_loadu_pd(rLenSq + k));
+		_mm_storeu_pd(out + k, _mm_mul_pd(c, _mm_mul_pd(t, t)));
+	}
+	wGradientFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void wLaplacianFuncP6Sse2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m128d h2 = _mm_set1_pd(kc.rangeSq);
+	const __m128d three = _mm_set1_pd(3);
+	const __m128d c = _mm_set1_pd(kc.p6WLaplacianConst);
+	int k = 0;
+	for (; k + 2 <= count; k += 2)
+	{
+		__m128d r2 = _mm_loadu_pd(rLenSq + k);
+		__m128d w = _mm_mul_pd(_mm_sub_pd(h2, r2), _mm_sub_pd(h2, _mm_mul_pd(three, r2)));
+		_mm_storeu_pd(out + k, _mm_mul_pd(c, w));
+	}
+	wLaplacianFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void wGradientFuncSpikySse2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m128d one = _mm_set1_pd(1);
+	const __m128d c = _mm_set1_pd(kc.spikyWGradientConst);
+	int k = 0;
+	for (; k + 2 <= count; k += 2)
+	{
+		__m128d qk = _mm_loadu_pd(q + k);
+		__m128d t = _mm_sub_pd(one, qk);
+		__m128d w = _mm_div_pd(_mm_mul_pd(c, _mm_mul_pd(t, t)), qk);
+		__m128d nonZero = _mm_cmpneq_pd(qk, _mm_setzero_pd());
+		_mm_storeu_pd(out + k, _mm_and_pd(nonZero, w));
+	}
+	wGradientFuncSpikyScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void wLaplacianFuncSse2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m128d one = _mm_set1_pd(1);
+	const __m128d c = _mm_set1_pd(kc.visWLaplacianConst);
+	int k = 0;
+	for (; k + 2 <= count; k += 2)
+	{
+		__m128d qk = _mm_loadu_pd(q + k);
+		__m128d nonZero = _mm_cmpneq_pd(qk, _mm_setzero_pd());
+		_mm_storeu_pd(out + k, _mm_and_pd(nonZero, _mm_mul_pd(c, _mm_sub_pd(one, qk))));
+	}
+	wLaplacianFuncScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void surfaceTensionCohesionKernelSse2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m128d h = _mm_set1_pd(kc.range);
+	const __m128d h2 = _mm_set1_pd(kc.rangeSq);
+	const __m128d halfH2 = _mm_set1_pd(kc.halfRangeSq);
+	const __m128d c = _mm_set1_pd(kc.cohesionKernelConst);
+	const __m128d offset = _mm_set1_pd(kc.cohesionKernelConst * kc.range4th / 16);
+	int k = 0;
+	for (; k + 2 <= count; k += 2)
+	{
+		__m128d r2 = _mm_loadu_pd(rLenSq + k);
+		__m128d t = _mm_sub_pd(h, _mm_mul_pd(_mm_loadu_pd(q + k), h));
+		__m128d w = _mm_mul_pd(c, _mm_mul_pd(_mm_mul_pd(t, t), r2));
+		__m128d inner = _mm_sub_pd(_mm_add_pd(w, w), offset);
+		w = selectSse2(_mm_cmple_pd(r2, halfH2), inner, w);
+		_mm_storeu_pd(out + k, _mm_and_pd(_mm_cmple_pd(r2, h2), w));
+	}
+	surfaceTensionCohesionKernelScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline __m128 selectSse2(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+KERNEL_TARGET_SSE2 static inline void wFuncP6Sse2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m128 one = _mm_set1_ps(1);
+	const __m128 rangeSqInv = _mm_set1_ps(1 / kc.rangeSq);
+	const __m128 c = _mm_set1_ps(kc.p6WConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 t = _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(one, _mm_mul_ps(_mm_loadu_ps(rLenSq + k), rangeSqInv)));
+		_mm_storeu_ps(out + k, _mm_mul_ps(c, _mm_mul_ps(t, _mm_mul_ps(t, t))));
+	}
+	wFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void wGradientFuncP6Sse2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m128 h2 = _mm_set1_ps(kc.rangeSq);
+	const __m128 c = _mm_set1_ps(kc.p6WGradientConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 t = _mm_sub_ps(h2, _mm_loadu_ps(rLenSq + k));
+		_mm_storeu_ps(out + k, _mm_mul_ps(c, _mm_mul_ps(t, t)));
+	}
+	wGradientFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void wLaplacianFuncP6Sse2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m128 h2 = _mm_set1_ps(kc.rangeSq);
+	const __m128 three = _mm_set1_ps(3);
+	const __m128 c = _mm_set1_ps(kc.p6WLaplacianConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 r2 = _mm_loadu_ps(rLenSq + k);
+		__m128 w = _mm_mul_ps(_mm_sub_ps(h2, r2), _mm_sub_ps(h2, _mm_mul_ps(three, r2)));
+		_mm_storeu_ps(out + k, _mm_mul_ps(c, w));
+	}
+	wLaplacianFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void wGradientFuncSpikySse2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m128 one = _mm_set1_ps(1);
+	const __m128 c = _mm_set1_ps(kc.spikyWGradientConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 qk = _mm_loadu_ps(q + k);
+		__m128 t = _mm_sub_ps(one, qk);
+		__m128 w = _mm_div_ps(_mm_mul_ps(c, _mm_mul_ps(t, t)), qk);
+		__m128 nonZero = _mm_cmpneq_ps(qk, _mm_setzero_ps());
+		_mm_storeu_ps(out + k, _mm_and_ps(nonZero, w));
+	}
+	wGradientFuncSpikyScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void wLaplacianFuncSse2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m128 one = _mm_set1_ps(1);
+	const __m128 c = _mm_set1_ps(kc.visWLaplacianConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 qk = _mm_loadu_ps(q + k);
+		__m128 nonZero = _mm_cmpneq_ps(qk, _mm_setzero_ps());
+		_mm_storeu_ps(out + k, _mm_and_ps(nonZero, _mm_mul_ps(c, _mm_sub_ps(one, qk))));
+	}
+	wLaplacianFuncScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_SSE2 static inline void surfaceTensionCohesionKernelSse2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m128 h = _mm_set1_ps(kc.range);
+	const __m128 h2 = _mm_set1_ps(kc.rangeSq);
+	const __m128 halfH2 = _mm_set1_ps(kc.halfRangeSq);
+	const __m128 c = _mm_set1_ps(kc.cohesionKernelConst);
+	const __m128 offset = _mm_set1_ps(kc.cohesionKernelConst * kc.range4th / 16);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 r2 = _mm_loadu_ps(rLenSq + k);
+		__m128 t = _mm_sub_ps(h, _mm_mul_ps(_mm_loadu_ps(q + k), h));
+		__m128 w = _mm_mul_ps(c, _mm_mul_ps(_mm_mul_ps(t, t), r2));
+		__m128 inner = _mm_sub_ps(_mm_add_ps(w, w), offset);
+		w = selectSse2(_mm_cmple_ps(r2, halfH2), inner, w);
+		_mm_storeu_ps(out + k, _mm_and_ps(_mm_cmple_ps(r2, h2), w));
+	}
+	surfaceTensionCohesionKernelScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+// AVX2 implementations, four doubles or eight floats per instruction.
+
+KERNEL_TARGET_AVX2 static inline void wFuncP6Avx2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m256d one = _mm256_set1_pd(1);
+	const __m256d rangeSqInv = _mm256_set1_pd(1 / kc.rangeSq);
+	const __m256d c = _mm256_set1_pd(kc.p6WConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m256d t = _mm256_max_pd(_mm256_setzero_pd(), _mm256_sub_pd(one, _mm256_mul_pd(_mm256_loadu_pd(rLenSq + k), rangeSqInv)));
+		_mm256_storeu_pd(out + k, _mm256_mul_pd(c, _mm256_mul_pd(t, _mm256_mul_pd(t, t))));
+	}
+	wFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wGradientFuncP6Avx2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m256d h2 = _mm256_set1_pd(kc.rangeSq);
+	const __m256d c = _mm256_set1_pd(kc.p6WGradientConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m256d t = _mm256_sub_pd(h2, _mm256_loadu_pd(rLenSq + k));
+		_mm256_storeu_pd(out + k, _mm256_mul_pd(c, _mm256_mul_pd(t, t)));
+	}
+	wGradientFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wLaplacianFuncP6Avx2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m256d h2 = _mm256_set1_pd(kc.rangeSq);
+	const __m256d three = _mm256_set1_pd(3);
+	const __m256d c = _mm256_set1_pd(kc.p6WLaplacianConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m256d r2 = _mm256_loadu_pd(rLenSq + k);
+		__m256d w = _mm256_mul_pd(_mm256_sub_pd(h2, r2), _mm256_sub_pd(h2, _mm256_mul_pd(three, r2)));
+		_mm256_storeu_pd(out + k, _mm256_mul_pd(c, w));
+	}
+	wLaplacianFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wGradientFuncSpikyAvx2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m256d one = _mm256_set1_pd(1);
+	const __m256d c = _mm256_set1_pd(kc.spikyWGradientConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m256d qk = _mm256_loadu_pd(q + k);
+		__m256d t = _mm256_sub_pd(one, qk);
+		__m256d w = _mm256_div_pd(_mm256_mul_pd(c, _mm256_mul_pd(t, t)), qk);
+		__m256d nonZero = _mm256_cmp_pd(qk, _mm256_setzero_pd(), _CMP_NEQ_OQ);
+		_mm256_storeu_pd(out + k, _mm256_and_pd(nonZero, w));
+	}
+	wGradientFuncSpikyScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wLaplacianFuncAvx2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m256d one = _mm256_set1_pd(1);
+	const __m256d c = _mm256_set1_pd(kc.visWLaplacianConst);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m256d qk = _mm256_loadu_pd(q + k);
+		__m256d nonZero = _mm256_cmp_pd(qk, _mm256_setzero_pd(), _CMP_NEQ_OQ);
+		_mm256_storeu_pd(out + k, _mm256_and_pd(nonZero, _mm256_mul_pd(c, _mm256_sub_pd(one, qk))));
+	}
+	wLaplacianFuncScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void surfaceTensionCohesionKernelAvx2(const KernelConstants& kc, const double* rLenSq, const double* q, int count, double* out)
+{
+	const __m256d h = _mm256_set1_pd(kc.range);
+	const __m256d h2 = _mm256_set1_pd(kc.rangeSq);
+	const __m256d halfH2 = _mm256_set1_pd(kc.halfRangeSq);
+	const __m256d c = _mm256_set1_pd(kc.cohesionKernelConst);
+	const __m256d offset = _mm256_set1_pd(kc.cohesionKernelConst * kc.range4th / 16);
+	int k = 0;
+	for (; k + 4 <= count; k += 4)
+	{
+		__m256d r2 = _mm256_loadu_pd(rLenSq + k);
+		__m256d t = _mm256_sub_pd(h, _mm256_mul_pd(_mm256_loadu_pd(q + k), h));
+		__m256d w = _mm256_mul_pd(c, _mm256_mul_pd(_mm256_mul_pd(t, t), r2));
+		__m256d inner = _mm256_sub_pd(_mm256_add_pd(w, w), offset);
+		w = _mm256_blendv_pd(w, inner, _mm256_cmp_pd(r2, halfH2, _CMP_LE_OQ));
+		_mm256_storeu_pd(out + k, _mm256_and_pd(_mm256_cmp_pd(r2, h2, _CMP_LE_OQ), w));
+	}
+	surfaceTensionCohesionKernelScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wFuncP6Avx2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m256 one = _mm256_set1_ps(1);
+	const __m256 rangeSqInv = _mm256_set1_ps(1 / kc.rangeSq);
+	const __m256 c = _mm256_set1_ps(kc.p6WConst);
+	int k = 0;
+	for (; k + 8 <= count; k += 8)
+	{
+		__m256 t = _mm256_max_ps(_mm256_setzero_ps(), _mm256_sub_ps(one, _mm256_mul_ps(_mm256_loadu_ps(rLenSq + k), rangeSqInv)));
+		_mm256_storeu_ps(out + k, _mm256_mul_ps(c, _mm256_mul_ps(t, _mm256_mul_ps(t, t))));
+	}
+	wFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wGradientFuncP6Avx2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m256 h2 = _mm256_set1_ps(kc.rangeSq);
+	const __m256 c = _mm256_set1_ps(kc.p6WGradientConst);
+	int k = 0;
+	for (; k + 8 <= count; k += 8)
+	{
+		__m256 t = _mm256_sub_ps(h2, _mm256_loadu_ps(rLenSq + k));
+		_mm256_storeu_ps(out + k, _mm256_mul_ps(c, _mm256_mul_ps(t, t)));
+	}
+	wGradientFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wLaplacianFuncP6Avx2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m256 h2 = _mm256_set1_ps(kc.rangeSq);
+	const __m256 three = _mm256_set1_ps(3);
+	const __m256 c = _mm256_set1_ps(kc.p6WLaplacianConst);
+	int k = 0;
+	for (; k + 8 <= count; k += 8)
+	{
+		__m256 r2 = _mm256_loadu_ps(rLenSq + k);
+		__m256 w = _mm256_mul_ps(_mm256_sub_ps(h2, r2), _mm256_sub_ps(h2, _mm256_mul_ps(three, r2)));
+		_mm256_storeu_ps(out + k, _mm256_mul_ps(c, w));
+	}
+	wLaplacianFuncP6Scalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wGradientFuncSpikyAvx2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m256 one = _mm256_set1_ps(1);
+	const __m256 c = _mm256_set1_ps(kc.spikyWGradientConst);
+	int k = 0;
+	for (; k + 8 <= count; k += 8)
+	{
+		__m256 qk = _mm256_loadu_ps(q + k);
+		__m256 t = _mm256_sub_ps(one, qk);
+		__m256 w = _mm256_div_ps(_mm256_mul_ps(c, _mm256_mul_ps(t, t)), qk);
+		__m256 nonZero = _mm256_cmp_ps(qk, _mm256_setzero_ps(), _CMP_NEQ_OQ);
+		_mm256_storeu_ps(out + k, _mm256_and_ps(nonZero, w));
+	}
+	wGradientFuncSpikyScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void wLaplacianFuncAvx2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m256 one = _mm256_set1_ps(1);
+	const __m256 c = _mm256_set1_ps(kc.visWLaplacianConst);
+	int k = 0;
+	for (; k + 8 <= count; k += 8)
+	{
+		__m256 qk = _mm256_loadu_ps(q + k);
+		__m256 nonZero = _mm256_cmp_ps(qk, _mm256_setzero_ps(), _CMP_NEQ_OQ);
+		_mm256_storeu_ps(out + k, _mm256_and_ps(nonZero, _mm256_mul_ps(c, _mm256_sub_ps(one, qk))));
+	}
+	wLaplacianFuncScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+KERNEL_TARGET_AVX2 static inline void surfaceTensionCohesionKernelAvx2(const KernelConstants& kc, const float* rLenSq, const float* q, int count, float* out)
+{
+	const __m256 h = _mm256_set1_ps(kc.range);
+	const __m256 h2 = _mm256_set1_ps(kc.rangeSq);
+	const __m256 halfH2 = _mm256_set1_ps(kc.halfRangeSq);
+	const __m256 c = _mm256_set1_ps(kc.cohesionKernelConst);
+	const __m256 offset = _mm256_set1_ps(kc.cohesionKernelConst * kc.range4th / 16);
+	int k = 0;
+	for (; k + 8 <= count; k += 8)
+	{
+		__m256 r2 = _mm256_loadu_ps(rLenSq + k);
+		__m256 t = _mm256_sub_ps(h, _mm256_mul_ps(_mm256_loadu_ps(q + k), h));
+		__m256 w = _mm256_mul_ps(c, _mm256_mul_ps(_mm256_mul_ps(t, t), r2));
+		__m256 inner = _mm256_sub_ps(_mm256_add_ps(w, w), offset);
+		w = _mm256_blendv_ps(w, inner, _mm256_cmp_ps(r2, halfH2, _CMP_LE_OQ));
+		_mm256_storeu_ps(out + k, _mm256_and_ps(_mm256_cmp_ps(r2, h2, _CMP_LE_OQ), w));
+	}
+	surfaceTensionCohesionKernelScalar(kc, rLenSq + k, q + k, count - k, out + k);
+}
+
+static inline bool cpuSupportsAvx2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static inline bool cpuSupportsSse2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif // KERNEL_BATCH_X86
+
+template <typename Real>
+static inline const KernelBatchFunctions<Real>& selectKernelBatchFunctions()
+{
+	static const KernelBatchFunctions<Real> scalar =
+	{
+		"scalar",
+		wFuncP6Scalar<Real>,
+		wGradientFuncP6Scalar<Real>,
+		wLaplacianFuncP6Scalar<Real>,
+		wGradientFuncSpikyScalar<Real>,
+		wLaplacianFuncScalar<Real>,
+		surfaceTensionCohesionKernelScalar<Real>,
+	};
+
+#ifdef KERNEL_BATCH_X86
+	// The overloads for Real are picked by the function pointer type.
+	static const KernelBatchFunctions<Real> sse2 =
+	{
+		"SSE2",
+		wFuncP6Sse2,
+		wGradientFuncP6Sse2,
+		wLaplacianFuncP6Sse2,
+		wGradientFuncSpikySse2,
+		wLaplacianFuncSse2,
+		surfaceTensionCohesionKernelSse2,
+	};
+
+	static const KernelBatchFunctions<Real> avx2 =
+	{
+		"AVX2",
+		wFuncP6Avx2,
+		wGradientFuncP6Avx2,
+		wLaplacianFuncP6Avx2,
+		wGradientFuncSpikyAvx2,
+		wLaplacianFuncAvx2,
+		surfaceTensionCohesionKernelAvx2,
+	};
+
+	if (cpuSupportsAvx2())
+		return avx2;
+
+	if (cpuSupportsSse2())
+		return sse2;
+#endif
+
+	return scalar;
+}
+
+template <typename Real>
+static inline const KernelBatchFunctions<Real>& getKernelBatchFunctions()
+{
+	static const KernelBatchFunctions<Real>& functions = selectKernelBatchFunctions<Real>();
+	return functions;
+}
+
+#endif // __KernelBatch_H__
\ No newline at end of file
@@ -1,145 +1,148 @@
 #ifndef __KernelFunctions_H__
 #define __KernelFunctions_H__
 
-#include "cocos2d.h"
+#include "math/CCGeometry.h"
 #include "Constants.h"
 #include "Particle.h"
 
 USING_NS_CC;
 
-static inline double wFuncP6(const Vec2& r)
+// Normalization constants of the kernels for a smoothing range.
+struct KernelConstants
 {
-	if (r.getLengthSq() > rangeSq)
-		return 0;
+	double range, halfRangeSq, rangeSq, range4th, range6th, range8th;
+	double p6WConst, p6WGradientConst, p6WLaplacianConst;
+	double spikyWConst, spikyWGradientConst;
+	double visWLaplacianConst;
+	double cohesionKernelConst;
 
-	const double q = r.getLength() / range;
+	KernelConstants(double range)
+	{
+		this->range = range;
+		halfRangeSq = (range / 2) * (range / 2);
+		rangeSq = range * range;
+		range4th = rangeSq * rangeSq;
+		range6th = range4th * rangeSq;
+		range8th = range4th * range4th;
+
+		p6WConst = 4 / M_PI / rangeSq;
+		p6WGradientConst = -24 / M_PI / range8th;
+		p6WLaplacianConst = -48 / M_PI / range8th;
+		spikyWConst = 10 / M_PI / rangeSq;
+		spikyWGradientConst = -30 / M_PI / range4th;
+		visWLaplacianConst = 40 / M_PI / range4th;
+		cohesionKernelConst = 10000 / range6th;
+	}
+};
 
-	return p6WConst * pow(1 - q * q, 3);
-}
+// Kernels of a single pair, evaluated on the squared distance and the normalized distance q = |r| / range cached in the
+// neighbor. Gradient kernels return the scalar c of grad W(r) = c * r.
 
-static inline Vec2 wGradientFuncP6(const Vec2& r)
+template <typename Real>
+static inline Real wFuncP6(Real rLenSq, const KernelConstants& kc)
 {
-	assert(r.getLengthSq() <= rangeSq);
+	if (rLenSq > (Real)kc.rangeSq)
+		return 0;
 
-	double lenSq = r.getLengthSq();
+	Real t = 1 - rLenSq / (Real)kc.rangeSq;
 
-	return (p6WGradientConst * (rangeSq - lenSq) * (rangeSq - lenSq)) * r;
+	return (Real)kc.p6WConst * t * t * t;
 }
 
-static inline double wLaplacianFuncP6(const Vec2& r)
+template <typename Real>
+static inline Real wLaplacianFuncP6(Real rLenSq, const KernelConstants& kc)
 {
-	assert(r.getLengthSq() <= rangeSq);
-
-	double lenSq = r.getLengthSq();
+	assert(rLenSq <= (Real)kc.rangeSq);
 
-	return p6WLaplacianConst * (rangeSq - lenSq) * (rangeSq - 3 * lenSq);
+	return (Real)kc.p6WLaplacianConst * ((Real)kc.rangeSq - rLenSq) * ((Real)kc.rangeSq - 3 * rLenSq);
 }
 
-static inline double wFuncSpiky(const Vec2& r)
+template <typename Real>
+static inline Real wFuncP6(const Neighbor<Real>& n, const KernelConstants& kc)
 {
-	assert(r.getLengthSq() <= rangeSq);
-
-	double q = r.getLength() / range;
-
-	return spikyWConst * pow(1 - q, 3);
+	return wFuncP6(n.rLenSq, kc);
 }
 
-static inline Vec2 wGradientFuncSpiky(const Vec2& r)
+template <typename Real>
+static inline Real wGradientFuncP6(const Neighbor<Real>& n, const KernelConstants& kc)
 {
-	if (r.getLengthSq() > rangeSq)
-		return Vec2::ZERO;
-
-	double q = r.getLength() / range;
-	if (q == 0)
-		return Vec2::ZERO;
+	assert(n.rLenSq <= (Real)kc.rangeSq);
 
-	double c = spikyWGradientConst * (1 - q) * (1 - q) / q;
+	Real t = (Real)kc.rangeSq - n.rLenSq;
 
-	return c * r;
+	return (Real)kc.p6WGradientConst * t * t;
 }
 
-static inline double wLaplacianFunc(const Vec2& r)
+template <typename Real>
+static inline Real wLaplacianFuncP6(const Neighbor<Real>& n, const KernelConstants& kc)
 {
-	assert(r.getLengthSq() <= rangeSq);
-
-	double q = r.getLength() / range;
-	if (q == 0)
-		return 0;
-
-	return visWLaplacianConst * (1 - q);
+	return wLaplacianFuncP6(n.rLenSq, kc);
 }
 
-static inline double wFuncP6(const Neighbor& n)
+template <typename Real>
+static inline Real wFuncSpiky(const Neighbor<Real>& n, const KernelConstants& kc)
 {
-	assert(n.r.getLengthSq() <= rangeSq);
+	assert(n.rLenSq <= (Real)kc.rangeSq);
 
-	return p6WConst * pow(1 - n.qSq, 3);
-}
-
-static inline Vec2 wGradientFuncP6(const Neighbor& n)
-{
-	assert(n.r.getLengthSq() <= rangeSq);
+	Real t = 1 - n.q;
 
-	return (p6WGradientConst * (rangeSq - n.rLenSq) * (rangeSq - n.rLenSq)) * n.r;
+	return (Real)kc.spikyWConst * t * t * t;
 }
 
-static inline double wLaplacianFuncP6(const Neighbor& n)
+template <typename Real>
+static inline Real wGradientFuncSpiky(const Neighbor<Real>& n, const KernelConstants& kc)
 {
-	assert(n.r.getLengthSq() <= rangeSq);
-
-	return p6WLaplacianConst * (rangeSq - n.rLenSq) * (rangeSq - 3 * n.rLenSq);
-}
+	if (n.rLenSq > (Real)kc.rangeSq || n.q == 0)
+		return 0;
 
-static inline double wFuncSpiky(const Neighbor& n)
-{
-	assert(n.r.getLengthSq() <= rangeSq);
+	Real t = 1 - n.q;
 
-	return spikyWConst * pow(1 - n.q, 3);
+	return (Real)kc.spikyWGradientConst * t * t / n.q;
 }
 
-static inline Vec2 wGradientFuncSpiky(const Neighbor& n)
+template <typename Real>
+static inline Real wLaplacianFunc(const Neighbor<Real>& n, const KernelConstants& kc)
 {
-	assert(n.r.getLengthSq() <= rangeSq);
-
-	double c = spikyWGradientConst * (1 - n.q) * (1 - n.q) / n.q;
-
-	return c * n.r;
-}
+	assert(n.rLenSq <= (Real)kc.rangeSq);
 
-static inline double wLaplacianFunc(const Neighbor& n)
-{
-	assert(n.r.getLengthSq() <= rangeSq);
+	if (n.q == 0)
+		return 0;
 
-	return visWLaplacianConst * (1 - n.q);
+	return (Real)kc.visWLaplacianConst * (1 - n.q);
 }
 
-static inline double surfaceTensionCohesionKernel(const Neighbor& n)
+template <typename Real>
+static inline Real surfaceTensionCohesionKernel(const Neighbor<Real>& n, const KernelConstants& kc)
 {
-	if (n.r.getLengthSq() > rangeSq)
+	if (n.rLenSq > (Real)kc.rangeSq)
 		return 0;
 
-	if (n.r.getLengthSq() <= halfRangeSq)
+	Real t = (Real)kc.range - n.q * (Real)kc.range;
+	if (n.rLenSq <= (Real)kc.halfRangeSq)
 	{
-		return cohesionKernelConst * (2 * (range - n.r.getLength()) * (range - n.r.getLength()) * n.rLenSq - range4th / 16);
+		return (Real)kc.cohesionKernelConst * (2 * t * t * n.rLenSq - (Real)(kc.range4th / 16));
 	}
 	else
 	{
-		return cohesionKernelConst * (range - n.r.getLength()) * (range - n.r.getLength()) * n.rLenSq;
+		return (Real)kc.cohesionKernelConst * t * t * n.rLenSq;
 	}
 }
 
-static inline double surfaceTensionCohesionKernel2(const Neighbor& n)
+template <typename Real>
+static inline Real surfaceTensionCohesionKernel2(const Neighbor<Real>& n, const KernelConstants& kc)
 {
-	if (n.r.getLengthSq() > rangeSq)
+	if (n.rLenSq > (Real)kc.rangeSq)
 		return 0;
 
-	if (n.r.getLengthSq() <= halfRangeSq)
+	Real rLen = n.q * (Real)kc.range;
+	Real t = (Real)kc.range - rLen;
+	if (n.rLenSq <= (Real)kc.halfRangeSq)
 	{
-		return cohesionKernelConst * (2 * pow(range - n.r.getLength(), 3) * pow(n.r.length(), 3) - range6th / 64);
+		return (Real)kc.cohesionKernelConst * (2 * t * t * t * rLen * rLen * rLen - (Real)(kc.range6th / 64));
 	}
 	else
 	{
-		return cohesionKernelConst * pow(range - n.r.getLength(), 3) * pow(n.r.length(), 3);
+		return (Real)kc.cohesionKernelConst * t * t * t * rLen * rLen * rLen;
 	}
 }
 
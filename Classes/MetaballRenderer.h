@@ -15,7 +15,7 @@ const float METABALL_LAYER_Z = -9;
 class MetaballRenderer : public Node
 {
 public:
-	static MetaballRenderer* create(SPHProcessor* processor, Rect renderRect, Sprite* rawBackgroundSp)
+	static MetaballRenderer* create(SPHProcessor<SphReal>* processor, Rect renderRect, Sprite* rawBackgroundSp)
 	{
 		MetaballRenderer* renderer = new MetaballRenderer(processor, renderRect, rawBackgroundSp);
 		renderer->autorelease();
@@ -30,7 +30,7 @@ public:
 
 	void update()
 	{
-		const auto& particles = processor->particles;
+		const ParticleStore<SphReal>& particles = processor->getParticles();
 
 		// 1. Draw particle properties onto the render target.
 		{
@@ -39,10 +39,10 @@ public:
 			drawNode->clear();
 			auto programState = drawNode->getGLProgramState();
 
-			for (auto& p : particles)
+			for (int i = 0; i < particles.size(); i++)
 			{
-				Vec2 vel = p.vel;
-				drawNode->drawDot(p.pos - renderRect.origin, renderRange, Color4F(vel.x, vel.y, 1, 1));
+				Vec2 vel = particles.vel.get(i);
+				drawNode->drawDot(particles.pos.get(i) - renderRect.origin, processor->getParameters().getRange(), Color4F(vel.x, vel.y, 1, 1));
 			}
 
 			drawNode->visit();
@@ -70,8 +70,7 @@ public:
 			debugDrawNode->clear();
 			for (int id : boundaryParticles)
 			{
-				const Particle& p = particles[id];
-				Vec2 pos = p.pos - renderRect.origin;
+				Vec2 pos = particles.pos.get(id) - renderRect.origin;
 				if (debugDrawMask & DEBUG_DRAW_BOUNDARY)
 				{
 					debugDrawNode->drawDot(pos, 2, Color4F(1, 1, 1, 1));
@@ -79,16 +78,17 @@ public:
 
 				if (debugDrawMask & DEBUG_DRAW_BOUNDARY_NORMAL)
 				{
-					debugDrawNode->drawSegment(pos, pos + p.surfaceNormal / p.surfaceNormal.getLength() * 10, 1, Color4F(1, 0, 0, 1));
+					Vec2 surfaceNormal = particles.surfaceNormal.get(id);
+					debugDrawNode->drawSegment(pos, pos + surfaceNormal / surfaceNormal.getLength() * 10, 1, Color4F(1, 0, 0, 1));
 				}
 			}
 
-			for (auto& p : particles)
+			for (int i = 0; i < particles.size(); i++)
 			{
-				Vec2 pos = p.pos - renderRect.origin;
+				Vec2 pos = particles.pos.get(i) - renderRect.origin;
 				if (debugDrawMask & DEBUG_DRAW_DENSITY)
 				{
-					if (Particle::getDensityErrorRate(p.density) > MAX_PCISPH_ERROR_RATE)
+					if (particles.getDensityErrorRate(particles.density[i]) > processor->getParameters().maxPcisphErrorRate)
 					{
 						debugDrawNode->drawDot(pos, 1, Color4F(1, 0, 0, 1));
 					}
@@ -106,7 +106,7 @@ public:
 	}
 
 protected:
-	SPHProcessor* processor;
+	SPHProcessor<SphReal>* processor;
 	Rect renderRect;
 	int debugDrawMask = 0;
 	DrawNode* drawNode;
@@ -121,7 +121,7 @@ protected:
 	Sprite* refractedBackgroundSp;
 	Sprite* finalImageSp;
 
-	MetaballRenderer(SPHProcessor* processor, Rect renderRect, Sprite* rawBackgroundSp)
+	MetaballRenderer(SPHProcessor<SphReal>* processor, Rect renderRect, Sprite* rawBackgroundSp)
 	{
 		this->rawBackgroundSp = rawBackgroundSp;
 		this->processor = processor;
@@ -3,139 +3,192 @@
 
 #include "SphProcessor.h"
 
-class PCISPH : public SPHProcessor
+template <typename Real, typename Policy>
+class PCISPH : public SPHProcessor<Real>
 {
 public:
-	PCISPH(Rect rect, Layer* container)
-		: SPHProcessor(rect, container)
+	PCISPH(Rect rect, const SphParameters& params)
+		: SPHProcessor<Real>(rect, params)
 	{}
 
 protected:
+	typedef SPHProcessor<Real> Base;
+	using Base::params;
+	using Base::kernelConstants;
+	using Base::particles;
+	using Base::getDefaultMass;
+	using Base::calculateDensity;
+	using Base::calculateNormalsAndForces;
+	using Base::calculatePressureForcePairs;
+	using Base::calculatePressureForceWithPos;
+	using Base::pressureGradient;
+	using Base::calculateBoundaryDensity;
+	using Base::calculateBoundaryForces;
+
+	double deltaDt = 0; // Time step computedDelta was computed for.
+	double computedDelta = 0;
+
 	virtual void calculateForces(double dt) override
 	{
-		double mass = getDefaultMass();
+		Policy policy;
+		Real mass = (Real)getDefaultMass();
+		const KernelBatchFunctions<Real>& kernels = getKernelBatchFunctions<Real>();
 
 		calculateDensity();
-		calculateNormalAndColorFieldLaplacian();
 
-		// Calculate surface tension and viscosity forces.
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-		for (int i = 0; i < particles.size(); i++)
 		{
-			Particle& p = particles[i];
-			if (surfaceTensionType == SurfaceTensionType::CohesionAndCurvature)
-			{
-				calculateSurfaceTensionForce2(p);
-			}
-			else
-			{
-				calculateSurfaceTensionForce(p);
-			}
-			calculateViscosityForce(p);
+			PhaseTimer timer(PhaseForces);
+			calculateNormalsAndForces(policy);
 		}
 
-		for (auto& p : particles)
-		{
-			p.forcePressure = Vec2::ZERO;
-			p.pressure = 0;
-		}
+		PhaseTimer timer(PhasePressureSolve);
+
+		particles.forcePressure.fill(0);
+		std::fill(particles.pressure.begin(), particles.pressure.end(), (Real)0);
+		Real delta = (Real)getDelta(dt, policy);
 
-		// Calculate delta for a particle with filled neighbors.
-		//double delta = 0;
-		//int maxNeighborCount = 0;
-		//Particle* sp;
-		//for (auto& p : particles)
-		//{
-		//	if (p.neighbors.size() > maxNeighborCount)
-		//	{
-		//		maxNeighborCount = p.neighbors.size();
-		//		sp = &p;
-		//	}
-		//}
-		//
-		//Vec2 wij = Vec2::ZERO;
-		//double wijsq = 0;
-		//for (auto& n : sp->neighbors)
-		//{
-		//	wij += wGradientFunc(n);
-		//	wijsq += wij.lengthSquared();
-		//}
-
-		//double beta = dt * dt * mass * mass * 2 / restDensity / restDensity;
-		//delta = 1 / beta / (wij.lengthSquared() + wijsq);
-		//delta = 10000;
-
-		bool erroneousDensity = true;
-
-		int it = 0;
-		while (erroneousDensity > MAX_PCISPH_ERROR_RATE && it++ < MAX_PCISPH_ITERATION)
+		// Iterate until the density error meets both criteria, within the iteration bounds.
+		DensityError<Real> error;
+		int iteration = 0;
+		do
 		{
+			TelemetryScope iterationScope("pcisphIteration");
+			Telemetry::getInstance().addCounter(CounterPressureIterations, 1);
+
 			// Predict particle positions.
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-			for (int i = 0; i < particles.size(); i++)
+			parallelFor(particles.size(), [&](int i)
 			{
-				Particle& p = particles[i];
-				Vec2 predictedVec = p.body->getVelocity() + dt * (p.forcePressure + p.forceSurface + p.forceViscosity) / mass;
-				p.predictedPos = p.pos + dt * predictedVec;
-			}
+				Real forceX = particles.forcePressure.x[i] + particles.forceSurface.x[i] + particles.forceViscosity.x[i];
+				Real forceY = particles.forcePressure.y[i] + particles.forceSurface.y[i] + particles.forceViscosity.y[i];
+				Real predictedVelX = particles.vel.x[i] + (Real)dt * forceX / mass;
+				Real predictedVelY = particles.vel.y[i] + (Real)dt * forceY / mass;
+				particles.predictedPos.set(i, particles.pos.x[i] + (Real)dt * predictedVelX, particles.pos.y[i] + (Real)dt * predictedVelY);
+			});
 
-			// Predict particle density.
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-			for (int i = 0; i < particles.size(); i++)
-			{
-				// Calculate density.
-				Particle& ps = particles[i];
-				ps.predictedDensity = wFuncP6(Vec2::ZERO);
-				for (auto& n : ps.neighbors)
-				{
-					ps.predictedDensity += wFuncP6(ps.predictedPos - n.p->predictedPos);
-				}
+			error = predictDensityAndPressure(delta, mass, kernels);
 
-				ps.predictedDensity *= mass;
+			// Calculate pressure force for time t.
+			if (USE_HALF_PAIR_FORCES)
+			{
+				calculatePressureForcePairs(policy);
 			}
-
-			// Update pressure.
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-			for (int i = 0; i < particles.size(); i++)
+			else
 			{
-				Particle& p = particles[i];
-				p.pressure += DELTA * (p.predictedDensity - restDensity);
+				parallelFor(particles.size(), [&](int i)
+				{
+					calculatePressureForceWithPos(i, policy);
+				});
 			}
 
-			// Calculate pressure force for time t.
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-			for (int i = 0; i < particles.size(); i++)
+			calculateBoundaryForces([this](int i) { return particles.pressure[i] * particles.densityInv[i] * particles.densityInv[i]; }, &particles.forcePressure, policy);
+
+			iteration++;
+		} while (iteration < params.minPcisphIteration || (!isConverged(error) && iteration < params.maxPcisphIteration));
+
+		Telemetry::getInstance().maxCounter(CounterMaxDensityError, error.max);
+	}
+
+	bool isConverged(const DensityError<Real>& error) const
+	{
+		return error.max <= (Real)params.maxPcisphErrorRate && error.average <= (Real)params.avgPcisphErrorRate;
+	}
+
+	// Predicts the density of every particle at the predicted positions, adds the density error to its pressure, and
+	// returns the largest and the average density error.
+	DensityError<Real> predictDensityAndPressure(Real delta, Real mass, const KernelBatchFunctions<Real>& kernels)
+	{
+		const Vec2Array<Real>& predictedPos = particles.predictedPos;
+		DensityErrorSum<Real> none = {};
+
+		DensityErrorSum<Real> errors = parallelReduce(particles.size(), none, [&](int begin, int end, DensityErrorSum<Real>& chunkErrors)
+		{
+			Real rLenSq[KERNEL_BATCH_SIZE];
+			Real w[KERNEL_BATCH_SIZE];
+
+			for (int i = begin; i < end; i++)
 			{
-				Particle& p = particles[i];
-				calculatePressureForceWithPos(p);
+				Real predictedDensity = wFuncP6<Real>(0, kernelConstants);
+				forEachNeighborBlock(particles.neighbors[i], [&](const Neighbor<Real>* first, int count)
+				{
+					for (int k = 0; k < count; k++)
+					{
+						Real dx = predictedPos.x[i] - predictedPos.x[first[k].j];
+						Real dy = predictedPos.y[i] - predictedPos.y[first[k].j];
+						rLenSq[k] = dx * dx + dy * dy;
+					}
+					kernels.wFuncP6(kernelConstants, rLenSq, rLenSq, count, w); // wFuncP6 only reads rLenSq.
+					for (int k = 0; k < count; k++)
+					{
+						predictedDensity += w[k];
+					}
+				});
+
+				predictedDensity = predictedDensity * mass + calculateBoundaryDensity(i, predictedPos);
+				particles.predictedDensity[i] = predictedDensity;
+				particles.pressure[i] += delta * (predictedDensity - particles.restDensity);
+
+				// Only compression counts, particles at the free surface never reach the rest density.
+				chunkErrors.add(std::max(predictedDensity - particles.restDensity, (Real)0) / particles.restDensity);
 			}
+		}, [](DensityErrorSum<Real>& errors, const DensityErrorSum<Real>& chunkErrors) { errors.add(chunkErrors); });
+
+		return errors.getError(particles.size());
+	}
 
-			// Calculate error rate.
-			erroneousDensity = false;
-			for (int i = 0; i < particles.size(); i++)
+	// The delta of PCISPH for dt, or params.delta if it is positive.
+	double getDelta(double dt, const Policy& policy)
+	{
+		if (params.delta > 0)
+			return params.delta;
+
+		if (dt != deltaDt)
+		{
+			deltaDt = dt;
+			computedDelta = params.deltaScale * computeDelta(dt, policy);
+		}
+		return computedDelta;
+	}
+
+	// Computes delta from a prototype particle with a full neighborhood, on a lattice of the rest spacing of the particles,
+	// as delta = 1 / (beta * (sum(grad Wd) . sum(grad Wp) + sum(grad Wd . grad Wp))) with beta = 2 * (dt * m / rho0)^2.
+	// Wd is the density kernel and Wp the pressure kernel, the density responds to the displacements the pressure causes.
+	double computeDelta(double dt, const Policy& policy) const
+	{
+		double spacing = sqrt(params.getArea());
+		double range = kernelConstants.range;
+		int steps = (int)(range / spacing);
+		Real rangeInv = (Real)(1 / range);
+		double sumDensityX = 0, sumDensityY = 0;
+		double sumPressureX = 0, sumPressureY = 0;
+		double sumProduct = 0;
+		for (int x = -steps; x <= steps; x++)
+		{
+			for (int y = -steps; y <= steps; y++)
 			{
-				if (Particle::getDensityErrorRate(particles[i].predictedDensity) > MAX_PCISPH_ERROR_RATE)
-				{
-					erroneousDensity = true;
-					break;
-				}
+				double rx = x * spacing;
+				double ry = y * spacing;
+				if ((x == 0 && y == 0) || rx * rx + ry * ry >= range * range)
+					continue;
+
+				Neighbor<Real> n(0, (Real)rx, (Real)ry, rangeInv);
+				double density = wGradientFuncP6(n, kernelConstants);
+				double pressure = pressureGradient(n, kernelConstants, policy);
+				sumDensityX += density * rx;
+				sumDensityY += density * ry;
+				sumPressureX += pressure * rx;
+				sumPressureY += pressure * ry;
+				sumProduct += density * pressure * (rx * rx + ry * ry);
 			}
 		}
+
+		double massOverDensity = params.getMass() / params.restDensity;
+		double beta = 2 * dt * dt * massOverDensity * massOverDensity;
+		return 1 / (beta * (sumDensityX * sumPressureX + sumDensityY * sumPressureY + sumProduct));
 	}
 
 	virtual int getSubStepCount() override
 	{
-		return PCISPH_SUBSTEP_COUNT;
+		return params.pcisphSubstepCount;
 	}
 };
 
@@ -1,63 +1,348 @@
 #ifndef __Particle_H__
 #define __Particle_H__
 
-#include "cocos2d.h"
+#include <cmath>
+#include <vector>
+#include "math/CCGeometry.h"
 #include "Constants.h"
 
 USING_NS_CC;
 
-struct Particle;
-
+template <typename Real>
 struct Neighbor
 {
-	Vec2 r;
-	double rLenSq, q, qSq;
-	const Particle* p;
+	Real rx, ry; // r = pos_i - pos_j
+	Real rLenSq, q;
+	int j; // Index of the neighbor in the particle store.
+
+	Neighbor()
+	{
+	}
+
+	Neighbor(int j, Real rx, Real ry, Real rangeInv)
+	{
+		this->j = j;
+		this->rx = rx;
+		this->ry = ry;
+		rLenSq = rx * rx + ry * ry;
+		q = std::sqrt(rLenSq) * rangeInv;
+	}
+};
+
+// The neighbors of a single particle, a view into a NeighborList.
+template <typename Real>
+struct NeighborRange
+{
+	const Neighbor<Real>* first;
+	const Neighbor<Real>* last;
+
+	const Neighbor<Real>* begin() const
+	{
+		return first;
+	}
+
+	const Neighbor<Real>* end() const
+	{
+		return last;
+	}
+
+	int size() const
+	{
+		return last - first;
+	}
+};
+
+// Compressed sparse row neighbor list. The neighbors of particle i are entries[offsets[i]] to entries[offsets[i + 1] - 1],
+// so the whole list lives in two flat arrays that keep their capacity from one rebuild to the next.
+template <typename Real>
+struct NeighborList
+{
+	std::vector<int> offsets;
+	std::vector<Neighbor<Real>> entries;
+
+	NeighborList()
+		: offsets(1, 0)
+	{
+	}
+
+	NeighborRange<Real> operator[](int i) const
+	{
+		const Neighbor<Real>* data = entries.data();
+		return NeighborRange<Real>{ data + offsets[i], data + offsets[i + 1] };
+	}
+
+	// Appends an empty neighbor list for a newly added particle.
+	void addParticle()
+	{
+		offsets.push_back(offsets.back());
+	}
+
+	void clear()
+	{
+		offsets.assign(1, 0);
+		entries.clear();
+	}
+
+	int pairCount() const
+	{
+		return entries.size();
+	}
+
+	// Moves the list of particle order[k] to row k and renames every neighbor index j to newIndex[j].
+	void reorder(const std::vector<int>& order, const std::vector<int>& newIndex)
+	{
+		std::vector<int> newOffsets(offsets.size());
+		std::vector<Neighbor<Real>> newEntries;
+		newEntries.reserve(entries.size());
+		for (int k = 0; k < order.size(); k++)
+		{
+			newOffsets[k] = newEntries.size();
+			for (int e = offsets[order[k]]; e < offsets[order[k] + 1]; e++)
+			{
+				Neighbor<Real> n = entries[e];
+				n.j = newIndex[n.j];
+				newEntries.push_back(n);
+			}
+		}
+		newOffsets[order.size()] = newEntries.size();
+
+		offsets.swap(newOffsets);
+		entries.swap(newEntries);
+	}
+};
+
+// The entries of a NeighborList grouped by neighbor. The entries with Neighbor::j == j are the list entries at
+// entries[offsets[j]] to entries[offsets[j + 1] - 1], in list order, so values kept per entry can be gathered per neighbor
+// in a fixed order instead of being scattered from several threads.
+struct ReverseNeighborList
+{
+	std::vector<int> offsets;
+	std::vector<int> entries;
+	std::vector<int> cursor;
+
+	// Builds the reverse of list for neighbor indices below count with a counting sort.
+	template <typename Real>
+	void build(const NeighborList<Real>& list, int count)
+	{
+		offsets.assign(count + 1, 0);
+		for (const Neighbor<Real>& n : list.entries)
+		{
+			offsets[n.j + 1]++;
+		}
+		for (int j = 0; j < count; j++)
+		{
+			offsets[j + 1] += offsets[j];
+		}
+
+		cursor.assign(offsets.begin(), offsets.end() - 1);
+		entries.resize(list.entries.size());
+		for (int e = 0; e < list.entries.size(); e++)
+		{
+			entries[cursor[list.entries[e].j]++] = e;
+		}
+	}
+};
+
+// A contiguous array of 2d vectors, stored as separate x and y component arrays. Vec2 is only used at the boundary to
+// chipmunk and the renderer, the solver works on the components directly.
+template <typename Real>
+struct Vec2Array
+{
+	std::vector<Real> x, y;
+
+	Vec2 get(int i) const
+	{
+		return Vec2(x[i], y[i]);
+	}
+
+	void set(int i, const Vec2& v)
+	{
+		x[i] = v.x;
+		y[i] = v.y;
+	}
+
+	void set(int i, Real vx, Real vy)
+	{
+		x[i] = vx;
+		y[i] = vy;
+	}
+
+	void add(int i, Real vx, Real vy)
+	{
+		x[i] += vx;
+		y[i] += vy;
+	}
+
+	Real getLength(int i) const
+	{
+		return std::sqrt(x[i] * x[i] + y[i] * y[i]);
+	}
+
+	void push_back(const Vec2& v)
+	{
+		x.push_back(v.x);
+		y.push_back(v.y);
+	}
+
+	// Copies a vector array of any precision.
+	template <typename OtherReal>
+	void assign(const Vec2Array<OtherReal>& other)
+	{
+		x.assign(other.x.begin(), other.x.end());
+		y.assign(other.y.begin(), other.y.end());
+	}
 
-	Neighbor(const Particle* p, Vec2 r)
+	void clear()
 	{
-		this->p = p;
-		this->r = r;
-		rLenSq = r.getLengthSq();
-		q = r.getLength() / range;
-		qSq = q * q;
+		x.clear();
+		y.clear();
+	}
+
+	int size() const
+	{
+		return x.size();
+	}
+
+	void reorder(const std::vector<int>& order)
+	{
+		reorderArray(x, order);
+		reorderArray(y, order);
+	}
+
+	void fill(Real value)
+	{
+		std::fill(x.begin(), x.end(), value);
+		std::fill(y.begin(), y.end(), value);
+	}
+
+	// Moves element order[k] of the array to position k.
+	template <typename T>
+	static void reorderArray(std::vector<T>& values, const std::vector<int>& order)
+	{
+		std::vector<T> reordered(values.size());
+		for (int k = 0; k < order.size(); k++)
+		{
+			reordered[k] = values[order[k]];
+		}
+		values.swap(reordered);
 	}
 };
 
-struct Particle
+// Structure-of-arrays particle storage. Every particle property lives in its own contiguous array indexed by the
+// particle id, so a kernel loop only pulls in the cache lines of the properties it actually reads. Real is the scalar type
+// of the solver, see SphReal.
+template <typename Real>
+class ParticleStore
 {
-	PhysicsBody* body;
-	Vec2 vel;
-	Vec2 pos;
-	Vec2 predictedPos;
-	std::vector<Neighbor> neighbors;
-	double density, densityInv, pressure;
-	double predictedDensity;
-	Vec2 forcePressure;
-	Vec2 forceViscosity;
-	Vec2 forceSurface;
-	Vec2 surfaceNormal;
-	double surfaceNormalLen;
-	double lap_cs; // Laplacian of color field
+public:
+	std::vector<int> id; // Index of the particle when it was added, stays with the particle when the store is reordered.
+	Vec2Array<Real> pos;
+	Vec2Array<Real> vel;
+	Vec2Array<Real> predictedPos;
+	std::vector<Real> density, densityInv, pressure;
+	std::vector<Real> predictedDensity;
+	Vec2Array<Real> forcePressure;
+	Vec2Array<Real> forceViscosity;
+	Vec2Array<Real> forceSurface;
+	Vec2Array<Real> surfaceNormal;
+	std::vector<Real> surfaceNormalLen;
+	std::vector<Real> lap_cs; // Laplacian of color field
+	Vec2Array<Real> velocityChange; // Velocity change of the current substep.
+	NeighborList<Real> neighbors;
+	Real restDensity;
 
-	static double getDensityErrorRate(double density)
+	ParticleStore(double restDensity = ::restDensity)
+		: restDensity((Real)restDensity)
 	{
-		return abs((density - restDensity) / restDensity);
 	}
 
-	Particle(PhysicsBody* body)
+	Real getDensityErrorRate(Real density) const
 	{
-		this->body = body;
+		return std::abs((density - restDensity) / restDensity);
 	}
 
-	double getDistance(const Particle& p) const
+	int add(const Vec2& p = Vec2::ZERO, const Vec2& v = Vec2::ZERO)
 	{
-		return pos.getDistance(p.pos);
+		id.push_back(size());
+		pos.push_back(p);
+		vel.push_back(v);
+		predictedPos.push_back(p);
+		density.push_back(restDensity);
+		densityInv.push_back(1 / restDensity);
+		pressure.push_back(0);
+		predictedDensity.push_back(restDensity);
+		forcePressure.push_back(Vec2::ZERO);
+		forceViscosity.push_back(Vec2::ZERO);
+		forceSurface.push_back(Vec2::ZERO);
+		surfaceNormal.push_back(Vec2::ZERO);
+		surfaceNormalLen.push_back(0);
+		lap_cs.push_back(0);
+		velocityChange.push_back(Vec2::ZERO);
+		neighbors.addParticle();
+
+		return size() - 1;
+	}
+
+	void clear()
+	{
+		id.clear();
+		pos.clear();
+		vel.clear();
+		predictedPos.clear();
+		density.clear();
+		densityInv.clear();
+		pressure.clear();
+		predictedDensity.clear();
+		forcePressure.clear();
+		forceViscosity.clear();
+		forceSurface.clear();
+		surfaceNormal.clear();
+		surfaceNormalLen.clear();
+		lap_cs.clear();
+		velocityChange.clear();
+		neighbors.clear();
+	}
+
+	int size() const
+	{
+		return id.size();
+	}
+
+	// Permutes all particles so that particle order[k] becomes particle k. newIndex receives the inverse mapping from old
+	// to new indices, for remapping particle indices kept outside the store.
+	void reorder(const std::vector<int>& order, std::vector<int>& newIndex)
+	{
+		assert(order.size() == size());
+
+		newIndex.resize(order.size());
+		for (int k = 0; k < order.size(); k++)
+		{
+			newIndex[order[k]] = k;
+		}
+
+		Vec2Array<Real>::reorderArray(id, order);
+		pos.reorder(order);
+		vel.reorder(order);
+		predictedPos.reorder(order);
+		Vec2Array<Real>::reorderArray(density, order);
+		Vec2Array<Real>::reorderArray(densityInv, order);
+		Vec2Array<Real>::reorderArray(pressure, order);
+		Vec2Array<Real>::reorderArray(predictedDensity, order);
+		forcePressure.reorder(order);
+		forceViscosity.reorder(order);
+		forceSurface.reorder(order);
+		surfaceNormal.reorder(order);
+		Vec2Array<Real>::reorderArray(surfaceNormalLen, order);
+		Vec2Array<Real>::reorderArray(lap_cs, order);
+		velocityChange.reorder(order);
+		neighbors.reorder(order, newIndex);
 	}
 
-	double getDistanceSq(const Particle& p) const
+	Real getDistanceSq(int i, int j) const
 	{
-		return pos.getDistanceSq(p.pos);
+		Real dx = pos.x[i] - pos.x[j];
+		Real dy = pos.y[i] - pos.y[j];
+		return dx * dx + dy * dy;
 	}
 };
 
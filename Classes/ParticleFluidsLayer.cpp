@@ -3,13 +3,12 @@
 #include "MetaballRenderer.h"
 #include "Telemetry.h"
 #include "BoxSprite.h"
-#include "PCISPH.h"
+#include "SolverFactory.h"
+#include "PrecisionComparison.h"
+#include "TaskScheduler.h"
 
 USING_NS_CC;
 
-int t_avgNeighbor = 0;
-int t_SphStepTime = 0;
-
 Scene* ParticleFluidsLayer::createScene()
 {
 	// 'scene' is an autorelease object
@@ -21,8 +20,6 @@ Scene* ParticleFluidsLayer::createScene()
 	// add layer as a child to scene
 	scene->addChild(layer);
 
-	omp_set_num_threads(OPENMP_THREAD_COUNT); // Setting thread num to core num causes instability when one of the core is being used.
-
 	// return the scene
 	return scene;
 }
@@ -49,27 +46,23 @@ ParticleFluidsLayer::~ParticleFluidsLayer()
 	metaballRenderer->release();
 }
 
-Particle createParticleWithPosition(Vec2 pos)
-{
-	auto body = PhysicsBody::createCircle(0.1);
-	auto sprite = Sprite::create();
-	sprite->setPosition(pos);
-	sprite->setPhysicsBody(body);
-	Particle p(body);
-	p.pos = pos;
-	return p;
-}
-
 void testSpatialGrid()
 {
-	SpatialGrid grid(Rect(0, 0, 30, 30), 10.0, 10.0);
-	std::vector<Particle> particles;
-	particles.push_back(createParticleWithPosition(Vec2(1, 19)));
-	particles.push_back(createParticleWithPosition(Vec2(11, 9)));
-	particles.push_back(createParticleWithPosition(Vec2(11, 19)));
-	particles.push_back(createParticleWithPosition(Vec2(11, 29)));
-	particles.push_back(createParticleWithPosition(Vec2(20, 10)));
-	particles.push_back(createParticleWithPosition(Vec2(21, 19)));
+	SpatialGrid<SphReal> grid(Rect(0, 0, 30, 30), 10.0, 10.0);
+	ParticleStore<SphReal> particles;
+	const Vec2 positions[] =
+	{
+		Vec2(1, 19),
+		Vec2(11, 9),
+		Vec2(11, 19),
+		Vec2(11, 29),
+		Vec2(20, 10),
+		Vec2(21, 19),
+	};
+	for (const Vec2& pos : positions)
+	{
+		particles.add(pos);
+	}
 	grid.initializeGrid(particles);
 
 	std::vector<int> neighborList[6] =
@@ -85,16 +78,15 @@ void testSpatialGrid()
 	grid.calculateNeighbors();
 	for (int i = 0; i < particles.size(); i++)
 	{
-		Particle& p = particles[i];
-		auto& neighbors = p.neighbors;
+		NeighborRange<SphReal> neighbors = particles.neighbors[i];
 		assert(neighbors.size() == neighborList[i].size());
 		for (int j = 0; j < neighbors.size(); j++)
 		{
-			const Particle* n = &particles[neighborList[i][j]];
+			int n = neighborList[i][j];
 			bool found = false;
 			for (auto neighbor : neighbors)
 			{
-				if (n == neighbor.p);
+				if (n == neighbor.j)
 				{
 					found = true;
 					break;
@@ -142,7 +134,6 @@ void ParticleFluidsLayer::initLayerElements()
 	physicsWorld->removeAllBodies();
 	physicsWorld->removeAllJoints();
 	//physicsWorld->setGravity(Vec2(0, 0));
-	physicsWorld->setGravity(Vec2(0, gravity));
 	physicsWorld->setIterations(20);
 	physicsWorld->setSpeed(speedMultiplier);
 
@@ -198,7 +189,19 @@ void ParticleFluidsLayer::initLayerElements()
 	particleCount->setAnchorPoint(Vec2(1, 3));
 	particleCount->setPosition(visibleSize.width, visibleSize.height);
 	this->addChild(particleCount);
-	auto usage = CCLabelTTF::create("Space: toggle debug draw\nLeft click: add a box\nB: toggle boundary particle marking\nN: toggle boundary particle normal\nM: toggle metaball view\nR: reset\nD: show density, green:close to rest density;red:errorous density", "Helvetica", 20);
+	if (COMPARE_PRECISION)
+	{
+		precisionDrift = CCLabelTTF::create("name", "Helvetica", 20);
+		precisionDrift->setAnchorPoint(Vec2(1, 4));
+		precisionDrift->setPosition(visibleSize.width, visibleSize.height);
+		this->addChild(precisionDrift);
+	}
+	phaseTimes = CCLabelTTF::create("", "Helvetica", 16);
+	phaseTimes->setHorizontalAlignment(TextHAlignment::RIGHT);
+	phaseTimes->setAnchorPoint(Vec2(1, 1));
+	phaseTimes->setPosition(visibleSize.width, visibleSize.height - 5 * sphStepTime->getContentSize().height);
+	this->addChild(phaseTimes);
+	auto usage = CCLabelTTF::create("Space: toggle debug draw\nLeft click: add a box\nB: toggle boundary particle marking\nN: toggle boundary particle normal\nM: toggle metaball view\nR: reset\nD: show density, green:close to rest density;red:errorous density\nT: start/stop a Chrome trace of the solver", "Helvetica", 20);
 	usage->setHorizontalAlignment(TextHAlignment::LEFT);
 	usage->setAnchorPoint(Vec2(0, 1));
 	usage->setPosition(0, visibleSize.height);
@@ -220,17 +223,19 @@ void ParticleFluidsLayer::initializeSPH()
 	this->addChild(screenEdge);
 
 	// Setup SPH Processor.
-	switch (solver)
+	sphParameters = SphParameters();
+	loadSphParameters(sphParameters, SPH_PARAMETER_FILE);
+	TaskScheduler::getInstance().setThreadCount(sphParameters.threadCount);
+	sphProcessor = createSPHProcessor<SphReal>(edgeRect, sphParameters);
+	sphConstraint = new SphConstraint(sphProcessor);
+	if (COMPARE_PRECISION)
 	{
-	case BasicSph:
-		sphProcessor = new SPHProcessor(edgeRect, this);
-		break;
-	case PciSph:
-		sphProcessor = new PCISPH(edgeRect, this);
-		break;
+		precisionComparison.reset(new PrecisionComparison<SphReal, SphShadowReal>(edgeRect, sphParameters));
+		sphProcessor->setSubstepObserver(precisionComparison.get());
 	}
 	auto physicsWorld = scene->getPhysicsWorld();
-	physicsWorld->addJoint(sphProcessor);
+	physicsWorld->setGravity(Vec2(0, sphParameters.gravity));
+	physicsWorld->addJoint(sphConstraint);
 
 	// Setup SPH renderer.
 	metaballRenderer = MetaballRenderer::create(sphProcessor, edgeRect, background);
@@ -246,9 +251,9 @@ void ParticleFluidsLayer::initializeSPH()
 	//addTrickle(edgeRect.getMidX(), edgeRect.getMidY(), 4.4, 100);
 
 	// Calcuate default mass base on current amount of fluids.
-	//sphProcessor->normalizeParticleMass();
+	//sphConstraint->normalizeParticleMass();
 
-	//sphProcessor->applyImpulseToParticles(Vect(10000 / PARTICLE_COUNT * 1000, 0));
+	//sphConstraint->applyImpulseToParticles(Vect(10000 / PARTICLE_COUNT * 1000, 0));
 
 	//schedule(schedule_selector(ParticleFluidsLayer::addDrop), 0, 1, 15);
 }
@@ -269,8 +274,14 @@ void ParticleFluidsLayer::addDrop(float dt)
 	addSquaredAmountFluid(edgeRect.getMidX() - 10, edgeRect.getMaxY() - 30, 7, 30);
 }
 
-PhysicsBody* ParticleFluidsLayer::addParticle(double x, double y)
+void ParticleFluidsLayer::addParticle(double x, double y)
 {
+	if (sphConstraint->isNativeCoupling())
+	{
+		sphConstraint->addParticle(Vec2(x, y));
+		return;
+	}
+
 	auto particle = Sprite::create();
 	auto particleBody = PhysicsBody::createCircle(0.001);
 	particleBody->getShapes().at(0)->setRestitution(0.1);
@@ -278,8 +289,7 @@ PhysicsBody* ParticleFluidsLayer::addParticle(double x, double y)
 	particle->setPosition(Vec2(x, y));
 	particle->setPhysicsBody(particleBody);
 	this->addChild(particle);
-	sphProcessor->addParticle(particleBody);
-	return particleBody;
+	sphConstraint->addParticle(particleBody);
 }
 
 bool ParticleFluidsLayer::onTouchBegan(Touch* touch, Event  *event)
@@ -350,6 +360,19 @@ void ParticleFluidsLayer::onKeyPressed(EventKeyboard::KeyCode keyCode, Event* un
 										  metaballRenderer->toggleDebugDrawMask(DEBUG_DRAW_DENSITY);
 										  break;
 	}
+	case EventKeyboard::KeyCode::KEY_T:
+	{
+										  Telemetry& telemetry = Telemetry::getInstance();
+										  if (telemetry.isTracing())
+										  {
+											  telemetry.stopTrace();
+										  }
+										  else
+										  {
+											  telemetry.startTrace(FileUtils::getInstance()->getWritablePath() + SPH_TRACE_FILE);
+										  }
+										  break;
+	}
 	}
 }
 
@@ -360,11 +383,12 @@ void ParticleFluidsLayer::addBox(Vec2 point, Size size)
 	box->setPhysicsBody(body);
 	box->setPosition(point);
 	this->addChild(box);
+	sphConstraint->addBoundaryBody(body);
 }
 
 void ParticleFluidsLayer::addSquaredAmountFluid(double x, double y, double width, double height)
 {
-	int count = (int)(width * height / area);
+	int count = (int)(width * height / sphParameters.getArea());
 	double unit = sqrt(count / (width * height)); // (w*unit) * (h*unit) =count
 	int xCount = width * unit;
 	int yCount = count / xCount;
@@ -393,14 +417,42 @@ void ParticleFluidsLayer::update(float delta)
 			std::stringstream ss;
 			ss.setf(std::ios::fixed);
 			ss.precision(1);
-			ss << "SPH step time " << (double)t_SphStepTime / 1000;
+			Telemetry& telemetry = Telemetry::getInstance();
+			const RollingStatistics& stepTime = telemetry.getFrameStatistics();
+			ss << "SPH step time " << stepTime.getPercentile(50) << " (p95 " << stepTime.getPercentile(95) << ", p99 " << stepTime.getPercentile(99) << ")";
+			if (telemetry.isTracing())
+				ss << " tracing";
 			sphStepTime->setString(ss.str());
 			ss.str("");
-			ss << "Avg neighbor count " << t_avgNeighbor;
+			int substeps = (int)telemetry.getCounterStatistics(CounterSubsteps).getLast();
+			int particleSubsteps = std::max(sphProcessor->particleCount() * substeps, 1);
+			ss << "Avg neighbor count " << (int)(telemetry.getCounterStatistics(CounterNeighborPairs).getLast() / particleSubsteps);
 			avgNeighborCount->setString(ss.str());
 			ss.str("");
 			ss << "Particle count " << sphProcessor->particleCount();
 			particleCount->setString(ss.str());
+			if (precisionDrift)
+			{
+				ss.str("");
+				ss.unsetf(std::ios::floatfield);
+				ss.precision(2);
+				ss << "Precision drift " << t_velocityDrift << " / " << t_densityDrift;
+				precisionDrift->setString(ss.str());
+			}
+
+			// Median of every phase, and how the pressure solver converged in the last frame.
+			ss.str("");
+			ss.setf(std::ios::fixed);
+			ss.precision(2);
+			for (int phase = 0; phase < SphPhaseCount; phase++)
+			{
+				ss << t_phaseNames[phase] << " " << telemetry.getPhaseStatistics((SphPhase)phase).getPercentile(50) << " ms\n";
+			}
+			ss << "Pressure iterations " << (int)telemetry.getCounterStatistics(CounterPressureIterations).getLast();
+			ss << ", divergence " << (int)telemetry.getCounterStatistics(CounterDivergenceIterations).getLast();
+			ss << ", max error " << telemetry.getCounterStatistics(CounterMaxDensityError).getLast();
+			ss << "\nSubsteps " << (int)telemetry.getCounterStatistics(CounterSubsteps).getLast();
+			phaseTimes->setString(ss.str());
 			cumulatedDelta = 0;
 		}
 
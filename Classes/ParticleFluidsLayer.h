@@ -3,6 +3,7 @@
 
 #include "cocos2d.h"
 #include "SphProcessor.h"
+#include "SphConstraint.h"
 
 class ParticleFluidsLayer : public cocos2d::Layer
 {
@@ -28,7 +29,12 @@ protected:
 	cocos2d::LabelTTF* sphStepTime;
 	cocos2d::LabelTTF* avgNeighborCount;
 	cocos2d::LabelTTF* particleCount;
-	SPHProcessor* sphProcessor;
+	cocos2d::LabelTTF* precisionDrift = nullptr;
+	cocos2d::LabelTTF* phaseTimes;
+	SphParameters sphParameters;
+	SPHProcessor<SphReal>* sphProcessor; // Owned by sphConstraint.
+	SphConstraint* sphConstraint;
+	std::unique_ptr<SubstepObserver<SphReal>> precisionComparison;
 	MetaballRenderer* metaballRenderer;
 
 	RenderTexture* r;
@@ -47,7 +53,7 @@ protected:
 	void initializeSPH();
 
 	void addDrop(float dt);
-	PhysicsBody* addParticle(double x, double y);
+	void addParticle(double x, double y);
 	void addSquaredAmountFluid(double x, double y, double width, double height);
 	void addTrickle(double x, double y, double interval, int count);
 	void addBox(Vec2 point, Size size);
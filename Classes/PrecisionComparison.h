@@ -0,0 +1,57 @@
+#ifndef __PrecisionComparison_H__
+#define __PrecisionComparison_H__
+
+#include <type_traits>
+#include "SolverFactory.h"
+#include "Telemetry.h"
+
+USING_NS_CC;
+
+// The other scalar type of the solver, used as the reference in precision comparisons.
+typedef std::conditional<std::is_same<SphReal, float>::value, double, float>::type SphShadowReal;
+
+// Runs a shadow solver of another precision on the particle state of every substep of the observed solver, and reports the
+// drift between the two in t_velocityDrift and t_densityDrift. Both solvers start each substep from the same positions
+// and velocities, so the drift is the error of a single substep rather than of two diverging simulations.
+template <typename Real, typename ShadowReal>
+class PrecisionComparison : public SubstepObserver<Real>
+{
+public:
+	PrecisionComparison(Rect rect, const SphParameters& params)
+		: shadow(createSPHProcessor<ShadowReal>(rect, params))
+	{
+	}
+
+	virtual void substepStarted(const ParticleStore<Real>& particles, double dt) override
+	{
+		shadow->simulateSubstep(particles, dt);
+	}
+
+	// The velocity drift is the largest difference of the velocity changes relative to the largest velocity change, the
+	// density drift the largest difference of the densities relative to the rest density.
+	virtual void substepFinished(const ParticleStore<Real>& particles) override
+	{
+		const ParticleStore<ShadowReal>& reference = shadow->getParticles();
+		double maxVelocityChangeSq = 0;
+		double maxDifferenceSq = 0;
+		double maxDensityDifference = 0;
+		for (int i = 0; i < particles.size(); i++)
+		{
+			double dvx = reference.velocityChange.x[i];
+			double dvy = reference.velocityChange.y[i];
+			double dx = particles.velocityChange.x[i] - dvx;
+			double dy = particles.velocityChange.y[i] - dvy;
+			maxVelocityChangeSq = std::max(maxVelocityChangeSq, dvx * dvx + dvy * dvy);
+			maxDifferenceSq = std::max(maxDifferenceSq, dx * dx + dy * dy);
+			maxDensityDifference = std::max(maxDensityDifference, std::abs((double)particles.density[i] - reference.density[i]));
+		}
+
+		t_velocityDrift = maxVelocityChangeSq > 0 ? sqrt(maxDifferenceSq / maxVelocityChangeSq) : 0;
+		t_densityDrift = maxDensityDifference / shadow->getParameters().restDensity;
+	}
+
+protected:
+	std::unique_ptr<SPHProcessor<ShadowReal>> shadow;
+};
+
+#endif // __PrecisionComparison_H__
\ No newline at end of file
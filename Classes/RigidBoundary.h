@@ -0,0 +1,145 @@
+#ifndef __RigidBoundary_H__
+#define __RigidBoundary_H__
+
+#include <cmath>
+#include <vector>
+#include "math/CCGeometry.h"
+#include "KernelFunctions.h"
+#include "Particle.h"
+#include "TaskScheduler.h"
+
+USING_NS_CC;
+
+// A rigid body the fluid sees through its boundary samples, see RigidBoundary.
+struct BoundaryBody
+{
+	int first, last; // Its samples are first to last - 1.
+	Vec2 pos; // Of the origin of the sample frame.
+	Vec2 rot; // Rotation of the sample frame as the unit vector (cos, sin).
+	Vec2 vel;
+	double angularVel;
+	Vec2 force; // Of the fluid on the body in the last substep.
+	double torque; // About pos.
+};
+
+// Boundary particles from "Versatile Rigid-Fluid Coupling for Incompressible SPH" (Akinci et al. 2012). The outlines of
+// the walls and rigid bodies are sampled once in the frame of their body, and the samples move with it. A sample b
+// contributes psi_b W to the density of the fluid around it, with psi_b = rho0 / sum_k W_bk its share of the rest density
+// among the other samples, so irregular samplings and thin walls give the same density as a filled fluid region. The
+// pressure of the fluid pushes off the samples as off a particle of mass psi_b, and the opposite forces add up to the force
+// and torque of the fluid on every body. The samples live in their own ParticleStore, so they get their own SpatialGrid.
+template <typename Real>
+class RigidBoundary
+{
+public:
+	ParticleStore<Real> samples; // World space positions and velocities of the samples.
+	Vec2Array<Real> localPos; // Positions of the samples in the frame of their body.
+	std::vector<Real> psi;
+	std::vector<int> body; // Index of the body of every sample.
+	Vec2Array<Real> force; // Of the fluid on every sample.
+	std::vector<BoundaryBody> bodies;
+
+	// Returns the index of the new body, which starts at rest at the origin.
+	int addBody(const std::vector<Vec2>& localSamples)
+	{
+		BoundaryBody b = {};
+		b.first = samples.size();
+		b.rot = Vec2(1, 0);
+		for (const Vec2& p : localSamples)
+		{
+			samples.add(p);
+			localPos.push_back(p);
+			psi.push_back(0);
+			body.push_back(bodies.size());
+			force.push_back(Vec2::ZERO);
+		}
+		b.last = samples.size();
+		bodies.push_back(b);
+		return bodies.size() - 1;
+	}
+
+	// Moves the samples of the body with it.
+	void setBodyState(int index, const Vec2& pos, const Vec2& rot, const Vec2& vel, double angularVel)
+	{
+		BoundaryBody& b = bodies[index];
+		b.pos = pos;
+		b.rot = rot;
+		b.vel = vel;
+		b.angularVel = angularVel;
+
+		for (int k = b.first; k < b.last; k++)
+		{
+			double rx = rot.x * localPos.x[k] - rot.y * localPos.y[k];
+			double ry = rot.y * localPos.x[k] + rot.x * localPos.y[k];
+			samples.pos.set(k, (Real)(pos.x + rx), (Real)(pos.y + ry));
+			samples.vel.set(k, (Real)(vel.x - angularVel * ry), (Real)(vel.y + angularVel * rx));
+		}
+	}
+
+	// Sets psi of every sample from the sample neighbors, which have to be up to date.
+	void calculateVolumes(const KernelConstants& kc, Real restDensity)
+	{
+		parallelFor(samples.size(), [&](int b)
+		{
+			Real weight = wFuncP6<Real>(0, kc);
+			for (auto& n : samples.neighbors[b])
+			{
+				weight += wFuncP6(n, kc);
+			}
+			psi[b] = restDensity / weight;
+		});
+	}
+
+	// Sums the sample forces up to the force and torque of every body.
+	void sumBodyForces()
+	{
+		for (BoundaryBody& b : bodies)
+		{
+			double forceX = 0, forceY = 0, torque = 0;
+			for (int k = b.first; k < b.last; k++)
+			{
+				forceX += force.x[k];
+				forceY += force.y[k];
+				torque += (samples.pos.x[k] - b.pos.x) * force.y[k] - (samples.pos.y[k] - b.pos.y) * force.x[k];
+			}
+			b.force = Vec2(forceX, forceY);
+			b.torque = torque;
+		}
+	}
+
+	int size() const
+	{
+		return samples.size();
+	}
+
+	// Appends samples every spacing along the segment from a to b, without b so closed outlines share their corners.
+	static void sampleSegment(const Vec2& a, const Vec2& b, double spacing, std::vector<Vec2>& out)
+	{
+		double length = a.distance(b);
+		int count = std::max((int)std::ceil(length / spacing), 1);
+		for (int k = 0; k < count; k++)
+		{
+			out.push_back(a.lerp(b, (float)k / count));
+		}
+	}
+
+	// Appends samples along the outline through count points, closed back to the first point if closed is set.
+	static void sampleOutline(const Vec2* points, int count, bool closed, double spacing, std::vector<Vec2>& out)
+	{
+		for (int k = 0; k + 1 < count; k++)
+		{
+			sampleSegment(points[k], points[k + 1], spacing, out);
+		}
+
+		if (closed && count > 1)
+		{
+			sampleSegment(points[count - 1], points[0], spacing, out);
+		}
+		else if (count > 0)
+		{
+			out.push_back(points[count - 1]);
+		}
+	}
+};
+
+#endif // __RigidBoundary_H__
\ No newline at end of file
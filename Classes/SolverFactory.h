@@ -0,0 +1,77 @@
+#ifndef __SolverFactory_H__
+#define __SolverFactory_H__
+
+#include "BasicSPH.h"
+#include "PCISPH.h"
+#include "DFSPH.h"
+#include "DoubleDensityRelaxation.h"
+
+// Creates the solver instantiation for a configuration. The configuration values are turned into template arguments once
+// here at startup, one value at a time, instead of being tested inside the per-particle loops.
+
+template <typename Real, typename Policy>
+static SPHProcessor<Real>* createSPHProcessorWithPolicy(SolverType type, Rect rect, const SphParameters& params)
+{
+	switch (type)
+	{
+	case BasicSph:
+		return new BasicSPH<Real, Policy>(rect, params);
+	case PciSph:
+		return new PCISPH<Real, Policy>(rect, params);
+	case DfSph:
+		return new DFSPH<Real, Policy>(rect, params);
+	case DoubleDensity:
+		return new DoubleDensityRelaxation<Real, Policy>(rect, params);
+	}
+
+	assert(false);
+	return nullptr;
+}
+
+template <typename Real, PressureKernelType PressureKernel, SurfaceTensionType SurfaceTension>
+static SPHProcessor<Real>* createSPHProcessorWithSurfaceTension(SolverType type, bool viscous, Rect rect, const SphParameters& params)
+{
+	if (viscous)
+		return createSPHProcessorWithPolicy<Real, SphPolicy<PressureKernel, SurfaceTension, true>>(type, rect, params);
+
+	return createSPHProcessorWithPolicy<Real, SphPolicy<PressureKernel, SurfaceTension, false>>(type, rect, params);
+}
+
+template <typename Real, PressureKernelType PressureKernel>
+static SPHProcessor<Real>* createSPHProcessorWithPressureKernel(SolverType type, SurfaceTensionType surfaceTension, bool viscous, Rect rect, const SphParameters& params)
+{
+	switch (surfaceTension)
+	{
+	case Basic:
+		return createSPHProcessorWithSurfaceTension<Real, PressureKernel, Basic>(type, viscous, rect, params);
+	case CohesionAndCurvature:
+		return createSPHProcessorWithSurfaceTension<Real, PressureKernel, CohesionAndCurvature>(type, viscous, rect, params);
+	}
+
+	assert(false);
+	return nullptr;
+}
+
+template <typename Real>
+static SPHProcessor<Real>* createSPHProcessor(SolverType type, PressureKernelType pressureKernel, SurfaceTensionType surfaceTension, bool viscous, Rect rect, const SphParameters& params)
+{
+	switch (pressureKernel)
+	{
+	case SpikyKernel:
+		return createSPHProcessorWithPressureKernel<Real, SpikyKernel>(type, surfaceTension, viscous, rect, params);
+	case Poly6Kernel:
+		return createSPHProcessorWithPressureKernel<Real, Poly6Kernel>(type, surfaceTension, viscous, rect, params);
+	}
+
+	assert(false);
+	return nullptr;
+}
+
+// Creates the solver selected by the parameters.
+template <typename Real>
+static SPHProcessor<Real>* createSPHProcessor(Rect rect, const SphParameters& params)
+{
+	return createSPHProcessor<Real>(params.solver, params.pressureKernel, params.surfaceTensionType, params.viscosity != 0, rect, params);
+}
+
+#endif // __SolverFactory_H__
\ No newline at end of file
@@ -1,14 +1,21 @@
 #ifndef __SpatialGrid_H__
 #define __SpatialGrid_H__
 
-#include "cocos2d.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <list>
+#include <memory>
+#include "math/CCGeometry.h"
 #include "Particle.h"
+#include "TaskScheduler.h"
 #include "Telemetry.h"
 
 USING_NS_CC;
 
-typedef std::list<Particle*> SpatialGridCell;
+typedef std::list<int> SpatialGridCell; // Indices into the particle store.
 
+template <typename Real>
 class SpatialGrid
 {
 public:
@@ -21,168 +28,587 @@ public:
 		xCount = (xh - xl) / gridSize + 1;
 		yCount = (yh - yl) / gridSize + 1;
 		size = xCount * yCount;
-		grid = std::make_unique<SpatialGridCell[]>(size);
+		if (gridType == LinkedListGrid)
+		{
+			grid = std::make_unique<SpatialGridCell[]>(size);
+		}
 		this->gridSize = gridSize;
+		gridSizeInv = 1 / gridSize;
 		this->neighborRange = neighborRange;
 		neighborRangeSq = neighborRange * neighborRange;
 		rangeInCellCount = (int)(neighborRange / gridSize) + 1;
 	}
 
-	void initializeGrid(std::vector<Particle>& particles)
+	// Makes updateGrid() rebuild the grid every rebuildInterval updates, on every update if it is 0, and whenever more than
+	// maxMovedFraction of the particles are away from their cell of the last rebuild.
+	void setRebuildPolicy(int rebuildInterval, double maxMovedFraction)
+	{
+		this->rebuildInterval = rebuildInterval;
+		this->maxMovedFraction = maxMovedFraction;
+	}
+
+	void initializeGrid(ParticleStore<Real>& particles)
 	{
+		this->particles = &particles;
+		updatesSinceRebuild = 0;
+		particleCells.resize(particles.size());
+
+		if (gridType == CountingSortGrid)
+		{
+			initializeCountingSortGrid();
+			return;
+		}
+		if (gridType == HashedGrid)
+		{
+			initializeHashedGrid();
+			return;
+		}
+
 		for (int i = 0; i < size; i++)
 		{
 			grid[i].clear();
 		}
 
-		for (Particle& p : particles)
+		for (int i = 0; i < particles.size(); i++)
 		{
-			int cell = getCellForPosition(p.body->getPosition());
-			if (cell >= 0 && cell < size)
-				grid[cell].push_back(&p);
-			p.neighbors.clear();
+			int cell = getCellForPosition(particles.pos.x[i], particles.pos.y[i]);
+			if (cell >= 0)
+			{
+				grid[cell].push_back(i);
+			}
+			particleCells[i] = cell;
 		}
 	}
 
-	void calculateNeighborsSymmetric()
+	// Brings the grid of the last initializeGrid() up to date with the particle positions by moving only the particles
+	// that changed their cell, which in resting fluid are few or none. A linked list grid moves their indices to the list
+	// of the new cell. The sorted grids keep the sorted particles of the last rebuild, skip the particles that left their
+	// cell there and link the moved particles into short lists of their new cells instead. Falls back to initializeGrid()
+	// when particles were added or as set by setRebuildPolicy().
+	void updateGrid()
 	{
-		for (int x = 0; x < xCount; x++)
+		int count = particles->size();
+		if (count != particleCells.size() || rebuildInterval <= 0 || ++updatesSinceRebuild >= rebuildInterval)
+		{
+			initializeGrid(*particles);
+			return;
+		}
+
+		updatedCells.resize(count);
+		int changedCount = parallelReduce(count, 0, [this](int begin, int end, int& chunkChanged)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				auto xy = getXYForPosition(particles->pos.x[i], particles->pos.y[i]);
+				updatedCells[i] = findCell(xy.first, xy.second);
+				if (updatedCells[i] != particleCells[i])
+				{
+					chunkChanged++;
+				}
+			}
+		}, [](int& changed, const int& chunkChanged) { changed += chunkChanged; });
+
+		if (changedCount == 0)
+			return;
+
+		if (gridType == LinkedListGrid)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				int cell = updatedCells[i];
+				if (cell == particleCells[i])
+					continue;
+
+				if (particleCells[i] >= 0)
+				{
+					grid[particleCells[i]].remove(i);
+				}
+				if (cell >= 0)
+				{
+					grid[cell].push_back(i);
+				}
+				particleCells[i] = cell;
+			}
+			return;
+		}
+
+		for (int i : movedParticles)
 		{
-			for (int y = 0; y < yCount; y++)
+			movedHead[particleCells[i]] = -1;
+		}
+
+		// Link in descending order, so that every list comes out in index order.
+		movedParticles.clear();
+		for (int i = count - 1; i >= 0; i--)
+		{
+			int cell = updatedCells[i];
+			if (gridType == HashedGrid && cell < 0)
 			{
-				int i = getCellForXY(x, y);
-				if (grid[i].size() > 0)
+				// The cell had no particles at the last rebuild, or it was added for another particle of this update.
+				auto xy = getXYForPosition(particles->pos.x[i], particles->pos.y[i]);
+				int slot = findCellSlot(xy.first, xy.second);
+				cell = cellTable[slot];
+				if (cell < 0)
 				{
-					for (Particle* pi : grid[i])
+					if (2 * (cellX.size() + 1) > cellTable.size())
 					{
-						// Calculate neighbors within cell.
-						for (Particle* pj : grid[i])
-						{
-							if (pi->pos.y < pj->pos.y || (pi->pos.y == pj->pos.y && pi->pos.x < pj->pos.x))
-							{
-								if (pi->getDistanceSq(*pj) <= neighborRangeSq)
-								{
-									appendNeighborSymmetric(pi, pj);
-								}
-							}
-						}
-
-						// Calculate neighbors on other cells.
-						appendNeighborsOnCellSymmetric(pi, x + 1, y);
-						appendNeighborsOnCellSymmetric(pi, x - 1, y + 1);
-						appendNeighborsOnCellSymmetric(pi, x, y + 1);
-						appendNeighborsOnCellSymmetric(pi, x + 1, y + 1);
+						initializeGrid(*particles);
+						return;
 					}
+
+					cell = cellX.size();
+					cellTable[slot] = cell;
+					cellX.push_back(xy.first);
+					cellY.push_back(xy.second);
+					cellStart.push_back(cellStart.back());
+					movedHead.push_back(-1);
 				}
 			}
+			particleCells[i] = cell;
+
+			if (cell >= 0 && cell != homeCells[i])
+			{
+				movedNext[i] = movedHead[cell];
+				movedHead[cell] = i;
+				movedParticles.push_back(i);
+			}
 		}
+
+		if (movedParticles.size() > maxMovedFraction * count)
+		{
+			initializeGrid(*particles);
+		}
+	}
+
+	// Copies every pair of the neighbor list once, to the particle with the lower index. Since the neighbor list is
+	// symmetric, the half list holds exactly the pairs the full list holds, in both grid and Verlet modes.
+	void calculateHalfNeighbors(NeighborList<Real>& halfNeighbors)
+	{
+		const NeighborList<Real>& neighbors = particles->neighbors;
+		buildNeighborList(halfNeighbors, particles->size(), [&neighbors](int pi, std::vector<Neighbor<Real>>& out)
+		{
+			for (auto& n : neighbors[pi])
+			{
+				if (n.j > pi)
+				{
+					out.push_back(n);
+				}
+			}
+		});
 	}
 
 	void calculateNeighbors()
 	{
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-		for (int x = 0; x < xCount; x++)
+		buildNeighborList(particles->neighbors, particles->size(), [this](int i, std::vector<Neighbor<Real>>& out) { appendNeighbors(i, out, neighborRangeSq); });
+	}
+
+	// Builds the neighbors of the particles of another store among the particles of this grid, e.g. the boundary samples
+	// around every fluid particle. Neighbor::j indexes the particles of this grid.
+	void calculateNeighborsOf(const ParticleStore<Real>& other, NeighborList<Real>& neighbors)
+	{
+		buildNeighborList(neighbors, other.size(), [this, &other](int i, std::vector<Neighbor<Real>>& out)
+		{
+			appendNeighborsAt(other.pos.x[i], other.pos.y[i], out);
+		});
+	}
+
+	// Builds a Verlet list of all pairs within neighborRange + skin. The grid size must be at least that range.
+	void calculateVerletCandidates(NeighborList<Real>& candidates, double skin)
+	{
+		assert(gridSize >= neighborRange + skin);
+
+		double candidateRangeSq = (neighborRange + skin) * (neighborRange + skin);
+		buildNeighborList(candidates, particles->size(), [this, candidateRangeSq](int i, std::vector<Neighbor<Real>>& out) { appendNeighbors(i, out, candidateRangeSq); });
+	}
+
+	// Filters a Verlet list down to the pairs within neighborRange at the current particle positions.
+	void calculateNeighborsFromCandidates(const NeighborList<Real>& candidates)
+	{
+		buildNeighborList(particles->neighbors, particles->size(), [this, &candidates](int pi, std::vector<Neighbor<Real>>& out)
 		{
-			for (int y = 0; y < yCount; y++)
+			for (auto& n : candidates[pi])
 			{
-				int i = getCellForXY(x, y);
-				if (grid[i].size() > 0)
+				if (particles->getDistanceSq(pi, n.j) <= neighborRangeSq)
 				{
-					for (Particle* pi : grid[i])
-					{
-						// Calculate neighbors within cell.
-						for (Particle* pj : grid[i])
-						{
-							if (pj->pos.x != pi->pos.x && pj->pos.y != pi->pos.y && pi->getDistanceSq(*pj) <= neighborRangeSq)
-							{
-								appendNeighbor(pi, pj);
-							}
-						}
-
-						// Calculate neighbors on other cells.
-						appendNeighborsOnCell(pi, x + 1, y);
-						appendNeighborsOnCell(pi, x - 1, y + 1);
-						appendNeighborsOnCell(pi, x, y + 1);
-						appendNeighborsOnCell(pi, x + 1, y + 1);
-						appendNeighborsOnCell(pi, x + 1, y - 1);
-						appendNeighborsOnCell(pi, x, y - 1);
-						appendNeighborsOnCell(pi, x - 1, y - 1);
-						appendNeighborsOnCell(pi, x - 1, y);
-					}
+					appendNeighbor(pi, n.j, out);
 				}
 			}
+		});
+	}
+
+	// Fills order with the particle indices sorted by the Morton code of their cells, so that particles close in space
+	// become close in memory once the store is reordered. Particles outside the grid are clamped to the border cells. A
+	// hashed grid has no border, its codes count from the lowest cell of the particles.
+	void calculateMortonOrder(const ParticleStore<Real>& particles, std::vector<int>& order)
+	{
+		int minX = 0, minY = 0;
+		int maxX = xCount - 1, maxY = yCount - 1;
+		if (gridType == HashedGrid)
+		{
+			minX = minY = INT_MAX;
+			for (int i = 0; i < particles.size(); i++)
+			{
+				auto xy = getXYForPosition(particles.pos.x[i], particles.pos.y[i]);
+				minX = std::min(minX, xy.first);
+				minY = std::min(minY, xy.second);
+			}
+			maxX = minX + 0xffff;
+			maxY = minY + 0xffff;
+		}
+
+		mortonKeys.resize(particles.size());
+		for (int i = 0; i < particles.size(); i++)
+		{
+			auto xy = getXYForPosition(particles.pos.x[i], particles.pos.y[i]);
+			int x = std::min(std::max(xy.first, minX), maxX) - minX;
+			int y = std::min(std::max(xy.second, minY), maxY) - minY;
+			mortonKeys[i] = std::make_pair(getMortonCode(x, y), i);
+		}
+
+		std::sort(mortonKeys.begin(), mortonKeys.end());
+
+		order.resize(particles.size());
+		for (int k = 0; k < particles.size(); k++)
+		{
+			order[k] = mortonKeys[k].second;
 		}
 	}
 
 protected:
 	std::unique_ptr<SpatialGridCell[]> grid;
-	double xl, xh, yl, yh, gridSize, neighborRange, neighborRangeSq, rangeInCellCount;
+	ParticleStore<Real>* particles = nullptr;
+	std::vector<int> particleCells; // Grid cell of each particle, -1 when outside the grid.
+	std::vector<int> cellStart; // Counting sort grid: particles of cell c are sortedParticles[cellStart[c]] to [cellStart[c + 1] - 1].
+	std::vector<int> cellCursor;
+	std::vector<int> sortedParticles;
+	std::vector<int> homeCells; // Sorted grids: cell of each particle in sortedParticles, as of the last full rebuild.
+	std::vector<int> updatedCells; // Cell of each particle at the current positions, found by updateGrid().
+	std::vector<int> movedParticles; // Sorted grids: particles within the grid but away from their home cell.
+	std::vector<int> movedHead, movedNext; // Sorted grids: moved particles of each cell, as -1 terminated linked lists.
+	int rebuildInterval = 0;
+	double maxMovedFraction = 0;
+	int updatesSinceRebuild = 0;
+	std::vector<int> cellX, cellY; // Hashed grid: coordinates of the occupied cells, in the order they were found.
+	std::vector<int> cellTable; // Hashed grid: open addressing table of cell indices, -1 for free slots.
+	int cellTableMask = 0;
+	std::vector<std::vector<Neighbor<Real>>> chunkEntries; // Neighbors gathered per chunk of particles by buildNeighborList().
+	std::vector<int> chunkStart; // Of the chunks in the neighbor list.
+	std::vector<std::pair<unsigned int, int>> mortonKeys;
+	double xl, xh, yl, yh, gridSize, gridSizeInv, neighborRange, neighborRangeSq, rangeInCellCount;
 	int xCount, yCount, size;
 
-	int getCellForPosition(const Vec2& pos)
+	// Sorts particle indices by cell with a two-pass counting sort: count the particles of each cell, then scatter the
+	// indices to the prefix sum of the counts. Particles of a cell stay in index order and all arrays keep their capacity.
+	void initializeCountingSortGrid()
+	{
+		int count = particles->size();
+		cellStart.assign(size + 1, 0);
+
+		for (int i = 0; i < count; i++)
+		{
+			int cell = getCellForPosition(particles->pos.x[i], particles->pos.y[i]);
+			if (cell >= 0)
+			{
+				cellStart[cell + 1]++;
+			}
+			particleCells[i] = cell;
+		}
+
+		sortParticlesByCell(size);
+	}
+
+	// The counting sort of initializeCountingSortGrid() over the occupied cells only. Every particle is binned, wherever
+	// it is, and the cells are found through a hash table of their coordinates that is kept at most half full, so memory
+	// and time follow the particle count rather than the area of the grid rect.
+	void initializeHashedGrid()
+	{
+		int count = particles->size();
+		int capacity = 16;
+		while (capacity < 2 * count)
+		{
+			capacity *= 2;
+		}
+		cellTable.assign(capacity, -1);
+		cellTableMask = capacity - 1;
+		cellX.clear();
+		cellY.clear();
+		cellStart.assign(1, 0);
+
+		for (int i = 0; i < count; i++)
+		{
+			auto xy = getXYForPosition(particles->pos.x[i], particles->pos.y[i]);
+			int slot = findCellSlot(xy.first, xy.second);
+			int cell = cellTable[slot];
+			if (cell < 0)
+			{
+				cell = cellX.size();
+				cellTable[slot] = cell;
+				cellX.push_back(xy.first);
+				cellY.push_back(xy.second);
+				cellStart.push_back(0);
+			}
+			cellStart[cell + 1]++;
+			particleCells[i] = cell;
+		}
+
+		sortParticlesByCell(cellX.size());
+	}
+
+	// Scatters the particle indices to the prefix sums of the particle counts of cellCount cells in cellStart.
+	void sortParticlesByCell(int cellCount)
 	{
-		const auto& cell = getXYForPosition(pos);
-		return getCellForXY(cell.first, cell.second);
+		for (int cell = 0; cell < cellCount; cell++)
+		{
+			cellStart[cell + 1] += cellStart[cell];
+		}
+
+		cellCursor.assign(cellStart.begin(), cellStart.end() - 1);
+		sortedParticles.resize(cellStart[cellCount]);
+		for (int i = 0; i < particles->size(); i++)
+		{
+			int cell = particleCells[i];
+			if (cell >= 0)
+			{
+				sortedParticles[cellCursor[cell]++] = i;
+			}
+		}
+
+		homeCells.assign(particleCells.begin(), particleCells.end());
+		movedParticles.clear();
+		movedHead.assign(cellCount, -1);
+		movedNext.resize(particles->size());
 	}
 
-	std::pair<int, int> getXYForPosition(const Vec2& pos)
+	// Slot of the hash table that holds cell (x, y), or the free slot it would go to.
+	int findCellSlot(int x, int y) const
 	{
-		int x = (int)((pos.x - xl) / gridSize);
-		int y = (int)((pos.y - yl) / gridSize);
-		return std::make_pair(x, y);
+		unsigned int hash = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u;
+		for (int slot = hash & cellTableMask;; slot = (slot + 1) & cellTableMask)
+		{
+			int cell = cellTable[slot];
+			if (cell < 0 || (cellX[cell] == x && cellY[cell] == y))
+				return slot;
+		}
 	}
 
-	int getCellForXY(int x, int y)
+	// The cell at grid coordinates (x, y), -1 when it is outside the grid rect or, in a hashed grid, has no particles.
+	int findCell(int x, int y) const
 	{
-		return x * yCount + y;
+		if (gridType == HashedGrid)
+			return cellTable[findCellSlot(x, y)];
+
+		return withinRange(x, y) ? getCellForXY(x, y) : -1;
 	}
 
-	bool withinRange(int x, int y)
+	std::pair<int, int> getXYForCell(int cell) const
 	{
-		return x >= 0 && y >= 0 && x < xCount && y < yCount;
+		if (gridType == HashedGrid)
+			return std::make_pair(cellX[cell], cellY[cell]);
+
+		return std::make_pair(cell / yCount, cell % yCount);
 	}
 
-	void appendNeighborsOnCellSymmetric(Particle* pi, int x, int y)
+	template <typename Visit>
+	void forEachParticleInCell(int cell, Visit visit)
 	{
-		if (withinRange(x, y))
+		if (gridType != LinkedListGrid)
 		{
-			for (Particle* pj : grid[getCellForXY(x, y)])
+			if (movedParticles.empty())
+			{
+				for (int k = cellStart[cell]; k < cellStart[cell + 1]; k++)
+				{
+					visit(sortedParticles[k]);
+				}
+				return;
+			}
+
+			for (int k = cellStart[cell]; k < cellStart[cell + 1]; k++)
 			{
-				if (pi->getDistanceSq(*pj) <= neighborRangeSq)
+				int pj = sortedParticles[k];
+				if (particleCells[pj] == cell)
 				{
-					appendNeighborSymmetric(pi, pj);
+					visit(pj);
 				}
 			}
+			for (int pj = movedHead[cell]; pj >= 0; pj = movedNext[pj])
+			{
+				visit(pj);
+			}
+		}
+		else
+		{
+			for (int pj : grid[cell])
+			{
+				visit(pj);
+			}
+		}
+	}
+
+	// Cell of a dense grid at a position, -1 outside the grid rect.
+	int getCellForPosition(Real px, Real py) const
+	{
+		const auto& cell = getXYForPosition(px, py);
+		return withinRange(cell.first, cell.second) ? getCellForXY(cell.first, cell.second) : -1;
+	}
+
+	std::pair<int, int> getXYForPosition(Real px, Real py) const
+	{
+		return std::make_pair(floorToInt((px - xl) * gridSizeInv), floorToInt((py - yl) * gridSizeInv));
+	}
+
+	// std::floor is a library call unless the compiler may use SSE4.1, and the cell of every particle goes through here.
+	static int floorToInt(double v)
+	{
+		int i = (int)v;
+		return v < i ? i - 1 : i;
+	}
+
+	int getCellForXY(int x, int y) const
+	{
+		return x * yCount + y;
+	}
+
+	// Spreads the lower 16 bits of v to the even bits of the result.
+	static unsigned int interleaveBits(unsigned int v)
+	{
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	}
+
+	static unsigned int getMortonCode(int x, int y)
+	{
+		return interleaveBits(x) | (interleaveBits(y) << 1);
+	}
+
+	bool withinRange(int x, int y) const
+	{
+		return x >= 0 && y >= 0 && x < xCount && y < yCount;
+	}
+
+	// Builds the neighbor list of count particles in two phases. The first gathers the lists of every chunk of particles in
+	// a retained buffer of the chunk, which gives the number of entries of each chunk. The second lays the chunks out at
+	// the prefix sums of these counts and fills them in. The chunks and the order within them do not depend on the
+	// workers, so neither does the list.
+	template <typename AppendNeighbors>
+	void buildNeighborList(NeighborList<Real>& neighbors, int count, AppendNeighbors appendNeighbors)
+	{
+		neighbors.offsets.resize(count + 1);
+
+		int chunkCount = (count + TASK_CHUNK_SIZE - 1) / TASK_CHUNK_SIZE;
+		if (chunkEntries.size() < chunkCount)
+			chunkEntries.resize(chunkCount);
+
+		parallelForChunks(count, [&](int begin, int end)
+		{
+			std::vector<Neighbor<Real>>& local = chunkEntries[begin / TASK_CHUNK_SIZE];
+			local.clear();
+			for (int i = begin; i < end; i++)
+			{
+				neighbors.offsets[i] = local.size();
+				appendNeighbors(i, local);
+			}
+		});
+
+		chunkStart.resize(chunkCount + 1);
+		chunkStart[0] = 0;
+		for (int c = 0; c < chunkCount; c++)
+		{
+			chunkStart[c + 1] = chunkStart[c] + chunkEntries[c].size();
 		}
+		neighbors.entries.resize(chunkStart[chunkCount]);
+		neighbors.offsets[count] = chunkStart[chunkCount];
+
+		parallelForChunks(count, [&](int begin, int end)
+		{
+			int c = begin / TASK_CHUNK_SIZE;
+			for (int i = begin; i < end; i++)
+			{
+				neighbors.offsets[i] += chunkStart[c];
+			}
+			std::copy(chunkEntries[c].begin(), chunkEntries[c].end(), neighbors.entries.begin() + chunkStart[c]);
+		});
 	}
 
-	void appendNeighborSymmetric(Particle* pi, Particle* pj)
+	void appendNeighbors(int pi, std::vector<Neighbor<Real>>& out, double rangeSq)
 	{
-		Vec2 r = pi->pos - pj->pos;
-		pi->neighbors.push_back(Neighbor(pj, r));
-		pj->neighbors.push_back(Neighbor(pi, -r));
+		int cell = particleCells[pi];
+		if (cell < 0)
+			return;
+
+		auto xy = getXYForCell(cell);
+		int x = xy.first;
+		int y = xy.second;
+
+		// Calculate neighbors within cell.
+		forEachParticleInCell(cell, [&](int pj)
+		{
+			if (pj != pi && particles->getDistanceSq(pi, pj) <= rangeSq)
+			{
+				appendNeighbor(pi, pj, out);
+			}
+		});
+
+		// Calculate neighbors on other cells.
+		appendNeighborsOnCell(pi, x + 1, y, out, rangeSq);
+		appendNeighborsOnCell(pi, x - 1, y + 1, out, rangeSq);
+		appendNeighborsOnCell(pi, x, y + 1, out, rangeSq);
+		appendNeighborsOnCell(pi, x + 1, y + 1, out, rangeSq);
+		appendNeighborsOnCell(pi, x + 1, y - 1, out, rangeSq);
+		appendNeighborsOnCell(pi, x, y - 1, out, rangeSq);
+		appendNeighborsOnCell(pi, x - 1, y - 1, out, rangeSq);
+		appendNeighborsOnCell(pi, x - 1, y, out, rangeSq);
 	}
 
-	void appendNeighborsOnCell(Particle* pi, int x, int y)
+	void appendNeighborsOnCell(int pi, int x, int y, std::vector<Neighbor<Real>>& out, double rangeSq)
 	{
-		if (withinRange(x, y))
+		int cell = findCell(x, y);
+		if (cell >= 0)
 		{
-			for (Particle* pj : grid[getCellForXY(x, y)])
+			forEachParticleInCell(cell, [&](int pj)
 			{
-				if (pi->getDistanceSq(*pj) <= neighborRangeSq)
+				if (particles->getDistanceSq(pi, pj) <= rangeSq)
 				{
-					appendNeighbor(pi, pj);
+					appendNeighbor(pi, pj, out);
 				}
+			});
+		}
+	}
+
+	// Appends the particles of this grid within neighborRange of a position that need not be in the grid.
+	void appendNeighborsAt(Real px, Real py, std::vector<Neighbor<Real>>& out)
+	{
+		auto xy = getXYForPosition(px, py);
+		const Vec2Array<Real>& pos = particles->pos;
+		Real rangeInv = (Real)(1 / neighborRange);
+		for (int x = xy.first - 1; x <= xy.first + 1; x++)
+		{
+			for (int y = xy.second - 1; y <= xy.second + 1; y++)
+			{
+				int cell = findCell(x, y);
+				if (cell < 0)
+					continue;
+
+				forEachParticleInCell(cell, [&](int pj)
+				{
+					Real dx = px - pos.x[pj];
+					Real dy = py - pos.y[pj];
+					if (dx * dx + dy * dy <= neighborRangeSq)
+					{
+						out.push_back(Neighbor<Real>(pj, dx, dy, rangeInv));
+					}
+				});
 			}
 		}
 	}
 
-	void appendNeighbor(Particle* pi, Particle* pj)
+	void appendNeighbor(int pi, int pj, std::vector<Neighbor<Real>>& out)
 	{
-		Vec2 r = pi->pos - pj->pos;
-		pi->neighbors.push_back(Neighbor(pj, r));
+		const Vec2Array<Real>& pos = particles->pos;
+		out.push_back(Neighbor<Real>(pj, pos.x[pi] - pos.x[pj], pos.y[pi] - pos.y[pj], (Real)(1 / neighborRange)));
 	}
 };
 
@@ -0,0 +1,297 @@
+#ifndef __SphBenchmark_H__
+#define __SphBenchmark_H__
+
+#include <chrono>
+#include <ctime>
+#include <ostream>
+#include <vector>
+#include "SolverFactory.h"
+#include "TaskScheduler.h"
+#include "Telemetry.h"
+
+USING_NS_CC;
+
+enum SphScenario
+{
+	DamBreak, // A square column of fluid collapsing into an empty tank.
+	RestingTank, // A tank half filled with fluid at rest.
+	DropletImpact, // A round drop falling into a shallow pool.
+	SphScenarioCount,
+};
+
+const char* const SPH_SCENARIO_NAMES[SphScenarioCount] = { "damBreak", "restingTank", "dropletImpact" };
+const char* const SPH_SOLVER_NAMES[] = { "basicSph", "pciSph", "dfSph", "doubleDensity" };
+const double SPH_BENCHMARK_STEP_TIME = 1.0 / 60;
+
+struct SphBenchmarkResult
+{
+	SphScenario scenario;
+	int particleCount;
+	int threadCount;
+	int substepCount; // Measured substeps, without the warmup.
+	double seconds; // Of the measured substeps.
+	double phaseSeconds[SphPhaseCount];
+	int pressureIterations;
+	int divergenceIterations;
+	double maxDensityError;
+	int avgNeighbor;
+	double frameTimeP50, frameTimeP95; // Milliseconds, over the last TELEMETRY_WINDOW frames.
+	double speedup; // Over the run of the same scenario and size with the fewest threads.
+
+	double getParticleStepsPerSecond() const
+	{
+		return (double)particleCount * substepCount / seconds;
+	}
+};
+
+// Runs the canonical scenarios headlessly on a fresh solver each and measures them. The scenes are sized from the
+// particle count with the particle spacing of ParticleFluidsLayer::addSquaredAmountFluid(), so every size sees the same
+// fluid at a different resolution of the tank.
+class SphBenchmark
+{
+public:
+	SphBenchmark(const SphParameters& params, int stepCount, int warmupStepCount)
+		: params(params)
+		, stepCount(stepCount)
+		, warmupStepCount(warmupStepCount)
+	{
+	}
+
+	SphBenchmarkResult run(SphScenario scenario, int particleCount, int threadCount)
+	{
+		SphParameters runParams = params;
+		runParams.threadCount = threadCount;
+		TaskScheduler::getInstance().setThreadCount(threadCount);
+
+		Rect tank = getTankRect(scenario, particleCount);
+		std::unique_ptr<SPHProcessor<SphReal>> processor(createSPHProcessor<SphReal>(tank, runParams));
+		addParticles(*processor, scenario, particleCount, tank);
+
+		for (int i = 0; i < warmupStepCount; i++)
+		{
+			processor->step(SPH_BENCHMARK_STEP_TIME);
+		}
+
+		Telemetry& telemetry = Telemetry::getInstance();
+		telemetry.resetTotals();
+		telemetry.clearStatistics();
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < stepCount; i++)
+		{
+			processor->step(SPH_BENCHMARK_STEP_TIME);
+		}
+
+		SphBenchmarkResult result;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.scenario = scenario;
+		result.particleCount = processor->particleCount();
+		result.threadCount = threadCount;
+		result.substepCount = (int)telemetry.getCounterTotal(CounterSubsteps);
+		for (int phase = 0; phase < SphPhaseCount; phase++)
+		{
+			result.phaseSeconds[phase] = telemetry.getPhaseTotal((SphPhase)phase);
+		}
+		result.pressureIterations = (int)telemetry.getCounterTotal(CounterPressureIterations);
+		result.divergenceIterations = (int)telemetry.getCounterTotal(CounterDivergenceIterations);
+		result.maxDensityError = telemetry.getCounterTotal(CounterMaxDensityError);
+		result.avgNeighbor = (int)(telemetry.getCounterTotal(CounterNeighborPairs) / result.substepCount / result.particleCount);
+		result.frameTimeP50 = telemetry.getFrameStatistics().getPercentile(50);
+		result.frameTimeP95 = telemetry.getFrameStatistics().getPercentile(95);
+		result.speedup = 1;
+		return result;
+	}
+
+	// Runs every combination, with the thread counts innermost so the speedups can be filled in.
+	std::vector<SphBenchmarkResult> run(const std::vector<SphScenario>& scenarios, const std::vector<int>& particleCounts, const std::vector<int>& threadCounts)
+	{
+		std::vector<SphBenchmarkResult> results;
+		for (SphScenario scenario : scenarios)
+		{
+			for (int particleCount : particleCounts)
+			{
+				int first = results.size();
+				for (int threadCount : threadCounts)
+				{
+					results.push_back(run(scenario, particleCount, threadCount));
+				}
+
+				for (int k = first; k < results.size(); k++)
+				{
+					results[k].speedup = results[first].seconds / results[k].seconds;
+				}
+			}
+		}
+
+		return results;
+	}
+
+	void writeTable(std::ostream& out, const std::vector<SphBenchmarkResult>& results) const
+	{
+		out << "scenario        particles threads  ms/substep  particle-steps/s  speedup";
+		for (int phase = 0; phase < SphPhaseCount; phase++)
+		{
+			out << "  " << t_phaseNames[phase];
+		}
+		out << std::endl;
+
+		for (const SphBenchmarkResult& r : results)
+		{
+			char line[128];
+			snprintf(line, sizeof(line), "%-15s %9d %7d %11.3f %17.4g %8.2f",
+				SPH_SCENARIO_NAMES[r.scenario], r.particleCount, r.threadCount, r.seconds * 1000 / r.substepCount, r.getParticleStepsPerSecond(), r.speedup);
+			out << line;
+			for (int phase = 0; phase < SphPhaseCount; phase++)
+			{
+				snprintf(line, sizeof(line), "  %*.3f", (int)strlen(t_phaseNames[phase]), r.phaseSeconds[phase] * 1000 / r.substepCount);
+				out << line;
+			}
+			out << std::endl;
+		}
+		out << "Phase columns are ms per substep." << std::endl;
+	}
+
+	// Writes the configuration and every run as one json object, for tracking the results over time.
+	void writeJson(std::ostream& out, const std::vector<SphBenchmarkResult>& results) const
+	{
+		out << "{" << std::endl;
+		out << "  \"timestamp\": " << (long long)std::time(nullptr) << "," << std::endl;
+		out << "  \"solver\": \"" << SPH_SOLVER_NAMES[params.solver] << "\"," << std::endl;
+		out << "  \"realBytes\": " << sizeof(SphReal) << "," << std::endl;
+		out << "  \"radius\": " << params.radius << "," << std::endl;
+		out << "  \"stepTime\": " << SPH_BENCHMARK_STEP_TIME << "," << std::endl;
+		out << "  \"steps\": " << stepCount << "," << std::endl;
+		out << "  \"warmupSteps\": " << warmupStepCount << "," << std::endl;
+		out << "  \"runs\": [" << std::endl;
+		for (int k = 0; k < results.size(); k++)
+		{
+			const SphBenchmarkResult& r = results[k];
+			out << "    { \"scenario\": \"" << SPH_SCENARIO_NAMES[r.scenario] << "\""
+				<< ", \"particles\": " << r.particleCount
+				<< ", \"threads\": " << r.threadCount
+				<< ", \"substeps\": " << r.substepCount
+				<< ", \"seconds\": " << r.seconds
+				<< ", \"particleStepsPerSecond\": " << r.getParticleStepsPerSecond()
+				<< ", \"speedup\": " << r.speedup
+				<< ", \"avgNeighbor\": " << r.avgNeighbor
+				<< ", \"pressureIterations\": " << r.pressureIterations
+				<< ", \"divergenceIterations\": " << r.divergenceIterations
+				<< ", \"maxDensityError\": " << r.maxDensityError
+				<< ", \"frameTimeP50\": " << r.frameTimeP50
+				<< ", \"frameTimeP95\": " << r.frameTimeP95
+				<< ", \"phaseSeconds\": {";
+			for (int phase = 0; phase < SphPhaseCount; phase++)
+			{
+				out << (phase ? ", " : " ") << "\"" << t_phaseNames[phase] << "\": " << r.phaseSeconds[phase];
+			}
+			out << " } }" << (k + 1 < results.size() ? "," : "") << std::endl;
+		}
+		out << "  ]" << std::endl;
+		out << "}" << std::endl;
+	}
+
+protected:
+	SphParameters params;
+	int stepCount;
+	int warmupStepCount;
+
+	double getSpacing() const
+	{
+		return sqrt(params.getArea());
+	}
+
+	// The side of a square holding the fluid of particleCount particles.
+	double getFluidSide(int particleCount) const
+	{
+		return sqrt((double)particleCount) * getSpacing();
+	}
+
+	Rect getTankRect(SphScenario scenario, int particleCount) const
+	{
+		double side = getFluidSide(particleCount);
+		switch (scenario)
+		{
+		case DamBreak:
+			return Rect(0, 0, 3 * side, 1.5 * side);
+		case RestingTank:
+			return Rect(0, 0, 2 * side, side);
+		case DropletImpact:
+			return Rect(0, 0, 2 * side, 1.5 * side);
+		default:
+			break;
+		}
+
+		assert(false);
+		return Rect::ZERO;
+	}
+
+	void addParticles(SPHProcessor<SphReal>& processor, SphScenario scenario, int particleCount, Rect tank) const
+	{
+		double spacing = getSpacing();
+		int tankColumns = (int)(tank.size.width / spacing);
+		switch (scenario)
+		{
+		case DamBreak:
+			addBlock(processor, Vec2::ZERO, (int)ceil(sqrt((double)particleCount)), particleCount);
+			break;
+		case RestingTank:
+			addBlock(processor, Vec2::ZERO, tankColumns, particleCount);
+			break;
+		case DropletImpact:
+		{
+			// A fifth of the fluid in the drop, which starts a drop diameter above the pool.
+			double side = getFluidSide(particleCount);
+			double dropRadius = sqrt(0.2 / M_PI) * side;
+			int dropCount = addDrop(processor, Vec2(tank.getMidX(), 0.4 * side + 3 * dropRadius), dropRadius, particleCount / 5);
+			addBlock(processor, Vec2::ZERO, tankColumns, particleCount - dropCount);
+			break;
+		}
+		default:
+			assert(false);
+			break;
+		}
+	}
+
+	// Adds count particles in rows of columns from the bottom left corner up. The positions are jittered slightly, so that
+	// neighbors do not share coordinates exactly.
+	void addBlock(SPHProcessor<SphReal>& processor, Vec2 origin, int columns, int count) const
+	{
+		double spacing = getSpacing();
+		for (int i = 0; i < count; i++)
+		{
+			double x = origin.x + (i % columns + 0.5 + getJitter(i)) * spacing;
+			double y = origin.y + (i / columns + 0.5 + getJitter(i + count)) * spacing;
+			processor.addParticle(Vec2(x, y));
+		}
+	}
+
+	// Adds up to maxCount particles on a lattice within the circle and returns the count added.
+	int addDrop(SPHProcessor<SphReal>& processor, Vec2 center, double radius, int maxCount) const
+	{
+		double spacing = getSpacing();
+		int steps = (int)(radius / spacing);
+		int count = 0;
+		for (int i = -steps; i <= steps; i++)
+		{
+			for (int j = -steps; j <= steps && count < maxCount; j++)
+			{
+				Vec2 offset((i + getJitter(count)) * spacing, (j + getJitter(count + maxCount)) * spacing);
+				if (offset.length() <= radius)
+				{
+					processor.addParticle(center + offset, Vec2(0, -0.5 * radius));
+					count++;
+				}
+			}
+		}
+
+		return count;
+	}
+
+	// Deterministic jitter in [-0.01, 0.01) of the spacing.
+	static double getJitter(int i)
+	{
+		unsigned int h = (unsigned int)i * 2654435761u;
+		return ((h >> 8) % 2000 / 1000.0 - 1) * 0.01;
+	}
+};
+
+#endif // __SphBenchmark_H__
\ No newline at end of file
@@ -0,0 +1,388 @@
+#include "SphConstraint.h"
+#include "physics/chipmunk/CCPhysicsJointInfo_chipmunk.h"
+#include "physics/chipmunk/CCPhysicsBodyInfo_chipmunk.h"
+
+USING_NS_CC;
+
+SphConstraint::SphConstraint(SPHProcessor<SphReal>* processor)
+	: processor(processor)
+{
+	a = PhysicsBody::create();
+	b = PhysicsBody::create();
+	a->retain();
+	b->retain();
+	PhysicsJoint::init(a, b);
+	cpConstraint* joint = new cpConstraint();
+	joint->a = getBodyInfo(a)->getBody();
+	joint->b = getBodyInfo(b)->getBody();
+	joint->preSolve = SphConstraint::preSolve;
+	joint->postSolve = SphConstraint::postSolve;
+
+	static const cpConstraintClass klass =
+	{
+		SphConstraint::preStep,
+		SphConstraint::applyCachedImpulseImpl,
+		SphConstraint::applyImpulseImpl,
+		SphConstraint::getImpulseImpl,
+	};
+
+	joint->klass_private = &klass;
+	joint->data = this;
+
+	_info->add(joint);
+}
+
+SphConstraint::~SphConstraint()
+{
+	a->release();
+	b->release();
+	for (PhysicsBody* body : boundaryBodies)
+	{
+		body->release();
+	}
+}
+
+void SphConstraint::addParticle(PhysicsBody* particle)
+{
+	int id = processor->addParticle(particle->getPosition(), particle->getVelocity());
+	assert(id == bodies.size());
+	bodies.push_back(particle);
+}
+
+void SphConstraint::addParticle(const Vec2& pos, const Vec2& vel)
+{
+	assert(isNativeCoupling());
+	processor->addParticle(pos, vel);
+}
+
+void SphConstraint::addBoundaryBody(PhysicsBody* body)
+{
+	std::vector<Vec2> samples;
+	double spacing = processor->getParameters().getBoundarySampleDistance();
+	for (PhysicsShape* shape : body->getShapes())
+	{
+		sampleShape(shape, spacing, samples);
+	}
+
+	int index = processor->addBoundaryBody(samples);
+	assert(index == boundaryBodies.size());
+	body->retain();
+	boundaryBodies.push_back(body);
+}
+
+// Samples the outline of the shape in the frame of its body.
+void SphConstraint::sampleShape(PhysicsShape* shape, double spacing, std::vector<Vec2>& samples)
+{
+	std::vector<Vec2> points;
+	bool closed = true;
+	switch (shape->getType())
+	{
+	case PhysicsShape::Type::CIRCLE:
+	{
+		PhysicsShapeCircle* circle = static_cast<PhysicsShapeCircle*>(shape);
+		double radius = circle->getRadius();
+		int count = std::max((int)std::ceil(2 * M_PI * radius / spacing), 3);
+		for (int k = 0; k < count; k++)
+		{
+			double angle = 2 * M_PI * k / count;
+			points.push_back(circle->getOffset() + Vec2(radius * cos(angle), radius * sin(angle)));
+		}
+		break;
+	}
+	case PhysicsShape::Type::BOX:
+		points.resize(4);
+		static_cast<PhysicsShapeBox*>(shape)->getPoints(points.data());
+		break;
+	case PhysicsShape::Type::POLYGEN:
+		points.resize(static_cast<PhysicsShapePolygon*>(shape)->getPointsCount());
+		static_cast<PhysicsShapePolygon*>(shape)->getPoints(points.data());
+		break;
+	case PhysicsShape::Type::EDGESEGMENT:
+		points.push_back(static_cast<PhysicsShapeEdgeSegment*>(shape)->getPointA());
+		points.push_back(static_cast<PhysicsShapeEdgeSegment*>(shape)->getPointB());
+		closed = false;
+		break;
+	case PhysicsShape::Type::EDGEBOX:
+		points.resize(4);
+		static_cast<PhysicsShapeEdgeBox*>(shape)->getPoints(points.data());
+		break;
+	case PhysicsShape::Type::EDGEPOLYGEN:
+		points.resize(static_cast<PhysicsShapeEdgePolygon*>(shape)->getPointsCount());
+		static_cast<PhysicsShapeEdgePolygon*>(shape)->getPoints(points.data());
+		break;
+	case PhysicsShape::Type::EDGECHAIN:
+		points.resize(static_cast<PhysicsShapeEdgeChain*>(shape)->getPointsCount());
+		static_cast<PhysicsShapeEdgeChain*>(shape)->getPoints(points.data());
+		closed = false;
+		break;
+	default:
+		break;
+	}
+
+	RigidBoundary<SphReal>::sampleOutline(points.data(), points.size(), closed, spacing, samples);
+}
+
+void SphConstraint::normalizeParticleMass()
+{
+	double mass = processor->normalizeParticleMass();
+	for (PhysicsBody* body : bodies)
+	{
+		body->setMass(mass);
+	}
+}
+
+void SphConstraint::applyImpulseToParticles(Vect impulse)
+{
+	if (isNativeCoupling())
+	{
+		processor->applyImpulseToParticles(impulse);
+		return;
+	}
+
+	for (PhysicsBody* body : bodies)
+	{
+		body->applyImpulse(impulse);
+	}
+}
+
+void SphConstraint::cacheBodyStates()
+{
+	const std::vector<int>& id = processor->getParticles().id;
+	for (int i = 0; i < processor->particleCount(); i++)
+	{
+		PhysicsBody* body = bodies[id[i]];
+		processor->setParticleState(i, body->getPosition(), body->getVelocity());
+	}
+}
+
+void SphConstraint::cacheBoundaryBodyStates()
+{
+	for (int i = 0; i < boundaryBodies.size(); i++)
+	{
+		cpBody* body = getBodyInfo(boundaryBodies[i])->getBody();
+		cpVect pos = cpBodyGetPos(body);
+		cpVect rot = cpBodyGetRot(body);
+		cpVect vel = cpBodyGetVel(body);
+		processor->setBoundaryBodyState(i, Vec2(pos.x, pos.y), Vec2(rot.x, rot.y), Vec2(vel.x, vel.y), cpBodyGetAngVel(body));
+	}
+}
+
+// Hands the forces of the fluid on the boundary bodies of the last substep on to chipmunk as impulses.
+void SphConstraint::applyBoundaryForces(double dt)
+{
+	for (int i = 0; i < boundaryBodies.size(); i++)
+	{
+		const BoundaryBody& boundaryBody = processor->getBoundaryBody(i);
+		cpVect impulse = cpv(boundaryBody.force.x * dt, boundaryBody.force.y * dt);
+		applyBodyImpulse(getBodyInfo(boundaryBodies[i])->getBody(), impulse, boundaryBody.torque * dt);
+	}
+}
+
+void SphConstraint::applyBodyImpulse(cpBody* body, cpVect impulse, double angularImpulse)
+{
+	if (cpBodyIsStatic(body) || cpBodyIsRogue(body) || (impulse.x == 0 && impulse.y == 0 && angularImpulse == 0))
+		return;
+
+	cpBodyActivate(body);
+	cpBodyApplyImpulse(body, impulse, cpvzero);
+	cpBodySetAngVel(body, cpBodyGetAngVel(body) + angularImpulse / cpBodyGetMoment(body));
+}
+
+void SphConstraint::applyVelocityChanges(double dt)
+{
+	PhaseTimer timer(PhaseIntegration);
+	const ParticleStore<SphReal>& particles = processor->getParticles();
+	double mass = processor->getDefaultMass();
+
+	// Applying an impulse activates the body and the bodies it touches in chipmunk, so the impulses go in serially.
+	for (int i = 0; i < particles.size(); i++)
+	{
+		bodies[particles.id[i]]->applyImpulse(Vec2(mass * particles.velocityChange.x[i], mass * particles.velocityChange.y[i]));
+	}
+
+	parallelFor(particles.size(), [&](int i)
+	{
+		// Velocities stay cached for the whole substep so neighbor loops never race with the impulses above. Chipmunk
+		// integrates the bodies after the step, predict the positions until the next cacheBodyStates().
+		SphReal vx = particles.velocityChange.x[i] + particles.vel.x[i];
+		SphReal vy = particles.velocityChange.y[i] + particles.vel.y[i];
+		processor->setParticleState(i, Vec2(particles.pos.x[i] + dt * vx, particles.pos.y[i] + dt * vy), Vec2(vx, vy));
+	});
+}
+
+void SphConstraint::collectShape(cpShape* shape, void* data)
+{
+	if (!cpShapeGetSensor(shape))
+	{
+		((std::vector<cpShape*>*)data)->push_back(shape);
+	}
+}
+
+// Pushes the particles out of the shapes and removes the velocity towards them, as chipmunk does for the particle bodies
+// with BodyCoupling. Static shapes are left to the distance field of the processor once it is built. All shapes are
+// found with a single query over the processor bounds, and the impulses of the particles on a shape are summed up first
+// and applied to its body once.
+void SphConstraint::resolveShapeCollisions(cpSpace* space)
+{
+	PhaseTimer timer(PhaseIntegration);
+	const ParticleStore<SphReal>& particles = processor->getParticles();
+	const SphParameters& params = processor->getParameters();
+	const Rect& bounds = processor->getBounds();
+	double mass = processor->getDefaultMass();
+	double contactRadius = params.getContactRadius();
+
+	// Impulse of the particles on one shape.
+	struct ShapeImpulse
+	{
+		cpVect linear;
+		double angular;
+	};
+
+	shapes.clear();
+	cpSpaceBBQuery(space, cpBBNew(bounds.getMinX(), bounds.getMinY(), bounds.getMaxX(), bounds.getMaxY()), CP_ALL_LAYERS, CP_NO_GROUP, SphConstraint::collectShape, &shapes);
+
+	for (cpShape* shape : shapes)
+	{
+		cpBody* body = cpShapeGetBody(shape);
+		if (cpBodyIsStatic(body) && processor->hasStaticBoundary())
+			continue;
+
+		cpVect center = cpBodyGetPos(body);
+		cpBB shapeBB = cpShapeGetBB(shape);
+		cpBB bb = cpBBNew(shapeBB.l - contactRadius, shapeBB.b - contactRadius, shapeBB.r + contactRadius, shapeBB.t + contactRadius);
+		double restitution = params.wallRestitution * cpShapeGetElasticity(shape);
+		ShapeImpulse none = {};
+
+		ShapeImpulse impulse = parallelReduce(particles.size(), none, [&](int begin, int end, ShapeImpulse& chunkImpulse)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				cpVect p = cpv(particles.pos.x[i], particles.pos.y[i]);
+				if (!cpBBContainsVect(bb, p))
+					continue;
+
+				cpNearestPointQueryInfo info;
+				cpShapeNearestPointQuery(shape, p, &info);
+				if (info.d >= contactRadius)
+					continue;
+
+				// The gradient points out of the shape, also when the particle is inside.
+				cpVect n = info.g;
+				p = cpvadd(p, cpvmult(n, contactRadius - info.d));
+				cpVect vel = cpv(particles.vel.x[i], particles.vel.y[i]);
+				cpVect relativeVel = cpvsub(vel, cpBodyGetVelAtWorldPoint(body, p));
+				double vn = cpvdot(relativeVel, n);
+				if (vn < 0)
+				{
+					cpVect velocityChange = cpvmult(n, -(1 + restitution) * vn);
+					vel = cpvadd(vel, velocityChange);
+
+					cpVect particleImpulse = cpvmult(velocityChange, -mass);
+					chunkImpulse.linear = cpvadd(chunkImpulse.linear, particleImpulse);
+					chunkImpulse.angular += cpvcross(cpvsub(p, center), particleImpulse);
+				}
+				processor->setParticleState(i, Vec2(p.x, p.y), Vec2(vel.x, vel.y));
+			}
+		}, [](ShapeImpulse& impulse, const ShapeImpulse& chunkImpulse)
+		{
+			impulse.linear = cpvadd(impulse.linear, chunkImpulse.linear);
+			impulse.angular += chunkImpulse.angular;
+		});
+
+		applyBodyImpulse(body, impulse.linear, impulse.angular);
+	}
+}
+
+// Builds the distance field of the processor from the static shapes around its bounds, once they are all in the space.
+void SphConstraint::buildStaticBoundary(cpSpace* space)
+{
+	const Rect& bounds = processor->getBounds();
+	double range = processor->getParameters().getRange();
+	shapes.clear();
+	cpSpaceBBQuery(space, cpBBNew(bounds.getMinX() - range, bounds.getMinY() - range, bounds.getMaxX() + range, bounds.getMaxY() + range), CP_ALL_LAYERS, CP_NO_GROUP, SphConstraint::collectShape, &shapes);
+	shapes.erase(std::remove_if(shapes.begin(), shapes.end(), [](cpShape* shape) { return !cpBodyIsStatic(cpShapeGetBody(shape)); }), shapes.end());
+
+	processor->buildStaticBoundary([this](double x, double y)
+	{
+		double distance = INFINITY;
+		for (cpShape* shape : shapes)
+		{
+			distance = std::min(distance, (double)cpShapeNearestPointQuery(shape, cpv(x, y), nullptr));
+		}
+		return distance;
+	});
+	staticBoundaryBuilt = true;
+}
+
+void SphConstraint::preSolve(cpConstraint *constraint, cpSpace *space)
+{
+}
+
+void SphConstraint::postSolve(cpConstraint *constraint, cpSpace *space)
+{
+}
+
+void SphConstraint::preStep(cpConstraint *constraint, cpFloat dt)
+{
+	SphConstraint* sphConstraint = (SphConstraint*)constraint->data;
+	SPHProcessor<SphReal>* processor = sphConstraint->processor.get();
+
+	if (!sphConstraint->staticBoundaryBuilt)
+	{
+		sphConstraint->buildStaticBoundary(cpConstraintGetSpace(constraint));
+	}
+
+	TelemetryFrame frame;
+	int substepCount = processor->chooseSubStepCount(dt);
+	double stepTime = dt / substepCount;
+
+	for (int it = 0; it < substepCount; it++)
+	{
+		TelemetryScope scope("substep");
+		sphConstraint->cacheBoundaryBodyStates();
+		if (sphConstraint->isNativeCoupling())
+		{
+			processor->advanceSubstep(stepTime);
+			sphConstraint->resolveShapeCollisions(cpConstraintGetSpace(constraint));
+		}
+		else
+		{
+			sphConstraint->cacheBodyStates();
+			processor->simulateSubstep(stepTime);
+			sphConstraint->applyVelocityChanges(stepTime);
+		}
+		sphConstraint->applyBoundaryForces(stepTime);
+	}
+}
+
+void SphConstraint::applyCachedImpulseImpl(cpConstraint *constraint, cpFloat dt_coef)
+{
+}
+
+void SphConstraint::applyImpulseImpl(cpConstraint *constraint, cpFloat dt)
+{
+}
+
+cpFloat SphConstraint::getImpulseImpl(cpConstraint *constraint)
+{
+	return 0;
+}
+
+bool loadSphParameters(SphParameters& params, const std::string& filename)
+{
+	FileUtils* fileUtils = FileUtils::getInstance();
+	if (!fileUtils->isFileExist(filename))
+		return false;
+
+	const std::string json = ".json";
+	if (filename.size() > json.size() && filename.compare(filename.size() - json.size(), json.size(), json) == 0)
+		return params.loadJson(fileUtils->getStringFromFile(filename));
+
+	SphParameterValues values;
+	for (auto& entry : fileUtils->getValueMapFromFile(filename))
+	{
+		values[entry.first] = entry.second.asDouble();
+	}
+
+	return params.load(values);
+}
\ No newline at end of file
@@ -2,12 +2,69 @@
 #define __SphConstraint_H__
 
 #include "cocos2d.h"
+#include "chipmunk.h"
+#include "SphProcessor.h"
 
+// Couples an SPHProcessor to chipmunk, see SphParameters::particleCoupling. With BodyCoupling every particle is a chipmunk
+// body: before each substep the constraint copies the body states into the processor, afterwards it applies the velocity
+// changes to the bodies as impulses, and chipmunk integrates them together with the rest of the world. With NativeCoupling
+// the particles only live in the processor, which integrates them itself. The constraint then collides them against the
+// chipmunk shapes within the bounds of the processor, and applies the impulses of all particles on a body at once. In both
+// modes, the static shapes in the space at the first step are turned into the distance field of the processor, see
+// DistanceField, and the rigid bodies added with addBoundaryBody() are sampled into boundary particles, see RigidBoundary,
+// which move with their bodies and take the forces of the fluid back to them. The constraint owns the processor, and the
+// PhysicsWorld owns the constraint once it is added.
 class SphConstraint : public cocos2d::PhysicsJoint
 {
 public:
+	SphConstraint(SPHProcessor<SphReal>* processor);
+	virtual ~SphConstraint();
+
+	void addParticle(PhysicsBody* particle); // With BodyCoupling.
+	void addParticle(const Vec2& pos, const Vec2& vel = Vec2::ZERO); // With NativeCoupling.
+	void addBoundaryBody(PhysicsBody* body); // Of a dynamic body, static ones are in the distance field.
+	void normalizeParticleMass();
+	void applyImpulseToParticles(Vect impulse);
+
+	SPHProcessor<SphReal>* getProcessor()
+	{
+		return processor.get();
+	}
+
+	bool isNativeCoupling() const
+	{
+		return processor->getParameters().particleCoupling == NativeCoupling;
+	}
 
 protected:
+	PhysicsBody *a, *b; // Fake bodies.
+	std::unique_ptr<SPHProcessor<SphReal>> processor;
+	std::vector<PhysicsBody*> bodies; // Indexed by particle id, with BodyCoupling.
+	std::vector<cpShape*> shapes; // Shapes overlapping the bounds of the processor, queried every substep.
+	std::vector<PhysicsBody*> boundaryBodies; // Indexed by boundary body index of the processor.
+	bool staticBoundaryBuilt = false;
+
+	void cacheBodyStates();
+	void cacheBoundaryBodyStates();
+	void applyVelocityChanges(double dt);
+	void applyBoundaryForces(double dt);
+	void resolveShapeCollisions(cpSpace* space);
+	void buildStaticBoundary(cpSpace* space);
+
+	static void sampleShape(PhysicsShape* shape, double spacing, std::vector<Vec2>& samples);
+	static void applyBodyImpulse(cpBody* body, cpVect impulse, double angularImpulse);
+	static void collectShape(cpShape* shape, void* data);
+
+	static void preSolve(cpConstraint *constraint, cpSpace *space);
+	static void postSolve(cpConstraint *constraint, cpSpace *space);
+	static void preStep(cpConstraint *constraint, cpFloat dt);
+	static void applyCachedImpulseImpl(cpConstraint *constraint, cpFloat dt_coef);
+	static void applyImpulseImpl(cpConstraint *constraint, cpFloat dt);
+	static cpFloat getImpulseImpl(cpConstraint *constraint);
 };
 
-#endif // __SphConstraint_H__
+// Overrides the parameters found in a plist or json file, read through FileUtils, see SphParameters::load(). Returns
+// false if the file cannot be read or a value was rejected.
+bool loadSphParameters(SphParameters& params, const std::string& filename);
+
+#endif // __SphConstraint_H__
\ No newline at end of file
@@ -0,0 +1,306 @@
+#ifndef __SphParameters_H__
+#define __SphParameters_H__
+
+#include <cassert>
+#include <cfloat>
+#include <climits>
+#include <cstdio>
+#include <map>
+#include <string>
+#include "CCStdC.h"
+#include "json/document.h"
+#include "Constants.h"
+
+const char* const SPH_PARAMETER_FILE = "SphParameters.plist"; // Loaded on every reset if it exists.
+
+typedef std::map<std::string, double> SphParameterValues;
+
+// Physical and numerical parameters of a simulation. They default to the values in Constants.h and can be overridden by a
+// plist or json file keyed by the member names, so tuning does not need a rebuild. A solver keeps a copy of the
+// parameters it was created with, and a changed file takes effect on the next reset. Reading a plist file needs cocos,
+// see loadSphParameters(), json text is parsed here so the headless engine can load it too.
+struct SphParameters
+{
+	// Solver
+	SolverType solver;
+	SurfaceTensionType surfaceTensionType;
+	PressureKernelType pressureKernel;
+	ParticleCoupling particleCoupling;
+	int threadCount; // 0 for one per core, see TaskScheduler::setThreadCount().
+
+	// Fluid
+	double gravity;
+	double viscosity;
+	double gasConstant;
+	double surfaceTension;
+	double surfaceTensionConst2;
+	double restDensity;
+
+	// Particle
+	double radius;
+
+	// SPH
+	double cXSPH;
+	double maxPressureForce;
+	double boundaryThreshold;
+	int substep;
+
+	// Adaptive substeps
+	double cflNumber;
+	double forceNumber;
+	int maxSubstepCount;
+
+	// PCISPH
+	int minPcisphIteration;
+	int maxPcisphIteration;
+	double maxPcisphErrorRate; // The iterations stop once both the largest and the average density error are below their rates.
+	double avgPcisphErrorRate;
+	double delta; // Computed from a prototype particle when not positive.
+	double deltaScale; // Scales the computed delta.
+	int pcisphSubstepCount;
+
+	// DFSPH
+	int maxDfsphIteration;
+	int maxDfsphDivergenceIteration;
+	double avgDfsphErrorRate;
+	double avgDfsphDivergenceErrorRate;
+	int dfsphSubstepCount;
+
+	// Double density relaxation
+	double relaxationStiffness;
+	double relaxationNearStiffness;
+	double relaxationSurfaceTension;
+	double relaxationLinearViscosity;
+	double relaxationQuadraticViscosity;
+	int relaxationIterationCount;
+	int relaxationSubstepCount;
+
+	// Integration by the engine, headless or with NativeCoupling.
+	double wallRestitution;
+
+	// Boundary particles
+	double boundarySpacing;
+
+	// Spatial grid
+	double verletSkin;
+	int mortonReorderInterval;
+	int gridRebuildInterval;
+	double gridMaxMovedFraction;
+
+	SphParameters()
+		: solver(::solver)
+		, surfaceTensionType(::surfaceTensionType)
+		, pressureKernel(::pressureKernel)
+		, particleCoupling(::particleCoupling)
+		, threadCount(THREAD_COUNT)
+		, gravity(::gravity)
+		, viscosity(::viscosity)
+		, gasConstant(::gasConstant)
+		, surfaceTension(::surfaceTension)
+		, surfaceTensionConst2(SurfaceTensionConst2)
+		, restDensity(::restDensity)
+		, radius(::radius)
+		, cXSPH(::cXSPH)
+		, maxPressureForce(::maxPressureForce)
+		, boundaryThreshold(::boundaryThreshold)
+		, substep(::substep)
+		, cflNumber(CFL_NUMBER)
+		, forceNumber(FORCE_NUMBER)
+		, maxSubstepCount(MAX_SUBSTEP_COUNT)
+		, minPcisphIteration(MIN_PCISPH_ITERATION)
+		, maxPcisphIteration(MAX_PCISPH_ITERATION)
+		, maxPcisphErrorRate(MAX_PCISPH_ERROR_RATE)
+		, avgPcisphErrorRate(AVG_PCISPH_ERROR_RATE)
+		, delta(DELTA)
+		, deltaScale(DELTA_SCALE)
+		, pcisphSubstepCount(PCISPH_SUBSTEP_COUNT)
+		, maxDfsphIteration(MAX_DFSPH_ITERATION)
+		, maxDfsphDivergenceIteration(MAX_DFSPH_DIVERGENCE_ITERATION)
+		, avgDfsphErrorRate(AVG_DFSPH_ERROR_RATE)
+		, avgDfsphDivergenceErrorRate(AVG_DFSPH_DIVERGENCE_ERROR_RATE)
+		, dfsphSubstepCount(DFSPH_SUBSTEP_COUNT)
+		, relaxationStiffness(RELAXATION_STIFFNESS)
+		, relaxationNearStiffness(RELAXATION_NEAR_STIFFNESS)
+		, relaxationSurfaceTension(RELAXATION_SURFACE_TENSION)
+		, relaxationLinearViscosity(RELAXATION_LINEAR_VISCOSITY)
+		, relaxationQuadraticViscosity(RELAXATION_QUADRATIC_VISCOSITY)
+		, relaxationIterationCount(RELAXATION_ITERATION_COUNT)
+		, relaxationSubstepCount(RELAXATION_SUBSTEP_COUNT)
+		, wallRestitution(::wallRestitution)
+		, boundarySpacing(BOUNDARY_SPACING)
+		, verletSkin(VERLET_SKIN)
+		, mortonReorderInterval(MORTON_REORDER_INTERVAL)
+		, gridRebuildInterval(GRID_REBUILD_INTERVAL)
+		, gridMaxMovedFraction(GRID_MAX_MOVED_FRACTION)
+	{
+	}
+
+	double getRange() const
+	{
+		return 4 * radius;
+	}
+
+	double getArea() const
+	{
+		return M_PI * radius * radius;
+	}
+
+	double getMass() const
+	{
+		return restDensity * getArea();
+	}
+
+	// Particles collide with the static geometry and chipmunk shapes as discs of this radius, about half their rest spacing.
+	double getContactRadius() const
+	{
+		return radius / 2;
+	}
+
+	// Distance between two boundary samples along a rigid body outline.
+	double getBoundarySampleDistance() const
+	{
+		return boundarySpacing * sqrt(getArea());
+	}
+
+	// Overrides the parameters found in the numbers of a flat json object, see load(). Returns false if the text cannot be
+	// parsed or a value was rejected.
+	bool loadJson(const std::string& text)
+	{
+		rapidjson::Document document;
+		document.Parse<0>(text.c_str());
+		if (document.HasParseError() || !document.IsObject())
+			return false;
+
+		SphParameterValues values;
+		for (auto it = document.MemberonBegin(); it != document.MemberonEnd(); ++it)
+		{
+			if (it->value.IsNumber())
+			{
+				values[it->name.GetString()] = it->value.GetDouble();
+			}
+		}
+
+		return load(values);
+	}
+
+	// Overrides the parameters found in values. A value that is out of range is logged and leaves its parameter unchanged,
+	// the others are still applied. Returns false if any value was rejected.
+	bool load(const SphParameterValues& values)
+	{
+		bool valid = true;
+		valid &= readEnum(values, "solver", solver, DoubleDensity);
+		valid &= readEnum(values, "surfaceTensionType", surfaceTensionType, CohesionAndCurvature);
+		valid &= readEnum(values, "pressureKernel", pressureKernel, Poly6Kernel);
+		valid &= readEnum(values, "particleCoupling", particleCoupling, NativeCoupling);
+		valid &= read(values, "threadCount", threadCount, 0);
+		valid &= read(values, "gravity", gravity);
+		valid &= read(values, "viscosity", viscosity, 0);
+		valid &= read(values, "gasConstant", gasConstant);
+		valid &= read(values, "surfaceTension", surfaceTension);
+		valid &= read(values, "surfaceTensionConst2", surfaceTensionConst2);
+		valid &= readPositive(values, "restDensity", restDensity);
+		valid &= readPositive(values, "radius", radius);
+		valid &= read(values, "cXSPH", cXSPH);
+		valid &= read(values, "maxPressureForce", maxPressureForce);
+		valid &= read(values, "boundaryThreshold", boundaryThreshold);
+		valid &= read(values, "substep", substep, 1);
+		valid &= read(values, "cflNumber", cflNumber, 0);
+		valid &= readPositive(values, "forceNumber", forceNumber);
+		valid &= read(values, "maxSubstepCount", maxSubstepCount, 1);
+		valid &= read(values, "minPcisphIteration", minPcisphIteration, 1);
+		valid &= read(values, "maxPcisphIteration", maxPcisphIteration, 1);
+		valid &= read(values, "maxPcisphErrorRate", maxPcisphErrorRate, 0);
+		valid &= read(values, "avgPcisphErrorRate", avgPcisphErrorRate, 0);
+		valid &= read(values, "delta", delta);
+		valid &= readPositive(values, "deltaScale", deltaScale);
+		valid &= read(values, "pcisphSubstepCount", pcisphSubstepCount, 1);
+		valid &= read(values, "maxDfsphIteration", maxDfsphIteration, 1);
+		valid &= read(values, "maxDfsphDivergenceIteration", maxDfsphDivergenceIteration, 0);
+		valid &= read(values, "avgDfsphErrorRate", avgDfsphErrorRate, 0);
+		valid &= read(values, "avgDfsphDivergenceErrorRate", avgDfsphDivergenceErrorRate, 0);
+		valid &= read(values, "dfsphSubstepCount", dfsphSubstepCount, 1);
+		valid &= read(values, "relaxationStiffness", relaxationStiffness);
+		valid &= read(values, "relaxationNearStiffness", relaxationNearStiffness);
+		valid &= read(values, "relaxationSurfaceTension", relaxationSurfaceTension);
+		valid &= read(values, "relaxationLinearViscosity", relaxationLinearViscosity);
+		valid &= read(values, "relaxationQuadraticViscosity", relaxationQuadraticViscosity);
+		valid &= read(values, "relaxationIterationCount", relaxationIterationCount, 1);
+		valid &= read(values, "relaxationSubstepCount", relaxationSubstepCount, 1);
+		valid &= read(values, "wallRestitution", wallRestitution);
+		valid &= readPositive(values, "boundarySpacing", boundarySpacing);
+		valid &= read(values, "verletSkin", verletSkin, 0);
+		valid &= read(values, "mortonReorderInterval", mortonReorderInterval, 0);
+		valid &= read(values, "gridRebuildInterval", gridRebuildInterval, 0);
+		valid &= read(values, "gridMaxMovedFraction", gridMaxMovedFraction, 0);
+
+		if (maxPcisphIteration < minPcisphIteration)
+		{
+			fprintf(stderr, "SphParameters: maxPcisphIteration %d is below the minimum, raised to %d\n",
+				maxPcisphIteration, minPcisphIteration);
+			maxPcisphIteration = minPcisphIteration;
+			valid = false;
+		}
+		return valid;
+	}
+
+protected:
+	// Reads value unless it is not finite or below min.
+	static bool read(const SphParameterValues& values, const char* key, double& value, double min = -DBL_MAX)
+	{
+		auto it = values.find(key);
+		if (it == values.end())
+			return true;
+
+		if (!(it->second >= min && it->second <= DBL_MAX))
+			return reject(key, it->second, value);
+
+		value = it->second;
+		return true;
+	}
+
+	// Reads value unless it is not a positive finite number.
+	static bool readPositive(const SphParameterValues& values, const char* key, double& value)
+	{
+		auto it = values.find(key);
+		if (it != values.end() && !(it->second > 0))
+			return reject(key, it->second, value);
+
+		return read(values, key, value);
+	}
+
+	// Reads value unless it is below min or beyond the range of int.
+	static bool read(const SphParameterValues& values, const char* key, int& value, int min = INT_MIN)
+	{
+		auto it = values.find(key);
+		if (it == values.end())
+			return true;
+
+		if (!(it->second >= min && it->second <= INT_MAX))
+			return reject(key, it->second, value);
+
+		value = (int)it->second;
+		return true;
+	}
+
+	// Reads an enum value from 0 to last.
+	template <typename Enum>
+	static bool readEnum(const SphParameterValues& values, const char* key, Enum& value, Enum last)
+	{
+		int i = value;
+		auto it = values.find(key);
+		if (it != values.end() && !(it->second <= last))
+			return reject(key, it->second, i);
+
+		bool valid = read(values, key, i, 0);
+		value = (Enum)i;
+		return valid;
+	}
+
+	static bool reject(const char* key, double rejected, double value)
+	{
+		fprintf(stderr, "SphParameters: %s %g is out of range, keeping %g\n", key, rejected, value);
+		return false;
+	}
+};
+
+#endif // __SphParameters_H__
\ No newline at end of file
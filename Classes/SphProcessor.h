@@ -1,453 +1,1077 @@
 #ifndef __SPHProcessor_H__
 #define __SPHProcessor_H__
 
-#include <omp.h>
-#include "cocos2d.h"
-#include "physics/chipmunk/CCPhysicsJointInfo_chipmunk.h"
-#include "physics/chipmunk/CCPhysicsBodyInfo_chipmunk.h"
+#include "TaskScheduler.h"
+#include "math/CCGeometry.h"
 #include "KernelFunctions.h"
+#include "KernelBatch.h"
+#include "DistanceField.h"
+#include "RigidBoundary.h"
 #include "SpatialGrid.h"
+#include "SphParameters.h"
 #include "Telemetry.h"
 
 USING_NS_CC;
 
-class SPHProcessor : public PhysicsJoint
+// Gets called around every substep of an SPHProcessor, e.g. to validate the solver against another one.
+template <typename Real>
+class SubstepObserver
 {
 public:
-	SPHProcessor(Rect rect, Layer* container)
+	virtual ~SubstepObserver()
 	{
-		a = PhysicsBody::create();
-		b = PhysicsBody::create();
-		a->retain();
-		b->retain();
-		PhysicsJoint::init(a, b);
-		cpConstraint* joint = new cpConstraint();
-		joint->a = getBodyInfo(a)->getBody();
-		joint->b = getBodyInfo(b)->getBody();
-		joint->preSolve = SPHProcessor::preSolve;
-		joint->postSolve = SPHProcessor::postSolve;
+	}
 
-		static const cpConstraintClass klass =
-		{
-			SPHProcessor::preStep,
-			SPHProcessor::applyCachedImpulseImpl,
-			SPHProcessor::applyImpulseImpl,
-			SPHProcessor::getImpulseImpl,
-		};
+	// Called once the particle state of the substep is cached, before any force is calculated.
+	virtual void substepStarted(const ParticleStore<Real>& particles, double dt) = 0;
+
+	// Called once the velocity changes of the substep are known.
+	virtual void substepFinished(const ParticleStore<Real>& particles) = 0;
+};
+
+// Compile-time configuration of the force calculations. Solvers take a policy as template argument, so every
+// configuration compiles to its own loops with the configuration branches folded away. See createSPHProcessor().
+template <PressureKernelType PressureKernel, SurfaceTensionType SurfaceTension, bool Viscosity>
+struct SphPolicy
+{
+	static const PressureKernelType pressureKernel = PressureKernel;
+	static const SurfaceTensionType surfaceTension = SurfaceTension;
+	static const bool viscosity = Viscosity;
+};
+
+// Density error rates of a pressure solver iteration, relative to the rest density.
+template <typename Real>
+struct DensityError
+{
+	Real max, average;
+};
 
-		joint->klass_private = &klass;
-		joint->data = this;
+// Largest and summed density error of a chunk of particles, see parallelReduce().
+template <typename Real>
+struct DensityErrorSum
+{
+	Real max, sum;
 
-		_info->add(joint);
+	void add(Real error)
+	{
+		max = std::max(max, error);
+		sum += error;
+	}
 
-		grid = std::make_unique<SpatialGrid>(rect, range + 0.1 , range);
+	void add(const DensityErrorSum& other)
+	{
+		max = std::max(max, other.max);
+		sum += other.sum;
+	}
+
+	DensityError<Real> getError(int count) const
+	{
+		DensityError<Real> error = { max, count > 0 ? sum / count : 0 };
+		return error;
+	}
+};
+
+// The fluid engine. It owns the particle state and needs neither GL, the Director nor a PhysicsWorld, only the cocos math
+// types. step() runs it standalone with its own integrator inside the bounds rect, SphConstraint couples it to chipmunk
+// instead. Real is the scalar type the solver computes in, the interface stays in float through Vec2.
+template <typename Real>
+class SPHProcessor
+{
+public:
+	SPHProcessor(Rect rect, const SphParameters& params)
+		: params(params)
+		, kernelConstants(params.getRange())
+		, particles(params.restDensity)
+		, bounds(rect)
+	{
+		grid = std::make_unique<SpatialGrid<Real>>(rect, params.getRange() + params.verletSkin + 0.1, params.getRange());
+		grid->setRebuildPolicy(params.gridRebuildInterval, params.gridMaxMovedFraction);
+
+		// Walls lie on the bounds, so the boundary grid reaches a range beyond them.
+		double range = params.getRange();
+		Rect boundaryRect(rect.getMinX() - range, rect.getMinY() - range, rect.size.width + 2 * range, rect.size.height + 2 * range);
+		boundaryGrid = std::make_unique<SpatialGrid<Real>>(boundaryRect, range + 0.1, range);
 	}
 
 	virtual ~SPHProcessor()
 	{
-		a->release();
-		b->release();
 	}
 
-	void addParticle(PhysicsBody* particle)
+	// Returns the id of the new particle, see ParticleStore::id.
+	int addParticle(const Vec2& pos, const Vec2& vel = Vec2::ZERO)
+	{
+		verletRebuildRequired = true;
+		return particles.add(pos, vel);
+	}
+
+	void setParticleState(int i, const Vec2& pos, const Vec2& vel)
 	{
-		Particle p(particle);
-		p.pressure = 0;
-		particles.push_back(std::move(p));
+		particles.pos.set(i, pos);
+		particles.vel.set(i, vel);
 	}
 
 	double getDefaultMass()
 	{
-		return mass;
+		return params.getMass();
 	}
 
 	// From http://www.cs.cornell.edu/~bindel/class/cs5220-f11/code/sph.pdf Item6. Does not seem to work.
-	void normalizeParticleMass()
+	double normalizeParticleMass()
 	{
 		defaultMass = 1;
 		calculateDensity();
-		float rho0 = restDensity;
+		float rho0 = params.restDensity;
 		float rhos = 0;
 		float rhos2 = 0;
-		for (Particle& p : particles)
+		for (double density : particles.density)
 		{
-			rhos += p.density;
-			rhos2 += p.density * p.density;
+			rhos += density;
+			rhos2 += density * density;
 		}
 
 		defaultMass = rho0 * rhos / rhos2;
+		return defaultMass;
+	}
+
+	void applyImpulseToParticles(Vec2 impulse)
+	{
+		Real mass = (Real)getDefaultMass();
+		for (int i = 0; i < particles.size(); i++)
+		{
+			particles.vel.add(i, impulse.x / mass, impulse.y / mass);
+		}
+	}
+
+	int particleCount()
+	{
+		return particles.size();
+	}
+
+	const ParticleStore<Real>& getParticles() const
+	{
+		return particles;
+	}
+
+	const SphParameters& getParameters() const
+	{
+		return params;
+	}
+
+	const Rect& getBounds() const
+	{
+		return bounds;
+	}
+
+	// Adds a rigid body the fluid sees through samples of its outline, in the frame of the body, see RigidBoundary. Returns
+	// the index of the body for setBoundaryBodyState() and getBoundaryBody().
+	int addBoundaryBody(const std::vector<Vec2>& localSamples)
+	{
+		return rigidBoundary.addBody(localSamples);
+	}
+
+	// Moves a boundary body, rot is the rotation as the unit vector (cos, sin).
+	void setBoundaryBodyState(int body, const Vec2& pos, const Vec2& rot, const Vec2& vel, double angularVel)
+	{
+		rigidBoundary.setBodyState(body, pos, rot, vel, angularVel);
+	}
+
+	// The force and torque of the fluid on the body are the ones of the last substep.
+	const BoundaryBody& getBoundaryBody(int body) const
+	{
+		return rigidBoundary.bodies[body];
+	}
+
+	const RigidBoundary<Real>& getRigidBoundary() const
+	{
+		return rigidBoundary;
+	}
+
+	// Builds the distance field of the static geometry from its signed distance function distance(x, y), negative inside.
+	// The bounds count as static geometry too. The fluid then feels the geometry through its density field, and advanceSubstep()
+	// keeps the particles out of it.
+	template <typename Distance>
+	void buildStaticBoundary(Distance distance)
+	{
+		double range = params.getRange();
+		Rect rect(bounds.getMinX() - range, bounds.getMinY() - range, bounds.size.width + 2 * range, bounds.size.height + 2 * range);
+		staticField.build(rect, params.getContactRadius(), [this, &distance](double x, double y)
+		{
+			double toBounds = std::min(std::min(x - bounds.getMinX(), bounds.getMaxX() - x), std::min(y - bounds.getMinY(), bounds.getMaxY() - y));
+			return std::min((double)distance(x, y), toBounds);
+		}, [this](double d) { return calculateWallDensity(d); });
+	}
+
+	bool hasStaticBoundary() const
+	{
+		return !staticField.isEmpty();
+	}
+
+	void setSubstepObserver(SubstepObserver<Real>* observer)
+	{
+		substepObserver = observer;
+	}
+
+	// The fixed substep count of the solver, and the least one chooseSubStepCount() picks.
+	virtual int getSubStepCount()
+	{
+		return params.substep;
+	}
 
-		for (Particle& p : particles)
+	// Chooses how many substeps a step of dt takes. With a positive cflNumber a substep is at most cflNumber * h / v_max,
+	// so the fastest particle moves at most cflNumber kernel ranges h, and at most forceNumber * sqrt(h / a_max) for the
+	// largest acceleration of the last substep. The count stays within getSubStepCount() and maxSubstepCount, and is
+	// added to the substep counter of the telemetry.
+	int chooseSubStepCount(double dt)
+	{
+		int minCount = getSubStepCount();
+		int substepCount = minCount;
+		if (params.cflNumber > 0)
 		{
-			p.body->setMass(defaultMass);
+			double maxSpeed, maxAcceleration;
+			calculateMaxSpeedAndAcceleration(maxSpeed, maxAcceleration);
+
+			double range = kernelConstants.range;
+			double stepTime = dt;
+			if (maxSpeed > 0)
+				stepTime = std::min(stepTime, params.cflNumber * range / maxSpeed);
+			if (maxAcceleration > 0)
+				stepTime = std::min(stepTime, params.forceNumber * std::sqrt(range / maxAcceleration));
+
+			substepCount = (int)std::ceil(dt / stepTime - 1e-6);
+			substepCount = std::max(std::min(substepCount, params.maxSubstepCount), minCount);
 		}
+
+		Telemetry::getInstance().addCounter(CounterSubsteps, substepCount);
+		return substepCount;
 	}
 
-	void applyImpulseToParticles(Vect impulse)
+	// Advances the simulation by dt without a physics engine, in chooseSubStepCount() substeps.
+	void step(double dt)
 	{
-		for (Particle& p : particles)
+		TelemetryFrame frame;
+		int substepCount = chooseSubStepCount(dt);
+		double stepTime = dt / substepCount;
+
+		for (int it = 0; it < substepCount; it++)
 		{
-			p.body->applyImpulse(impulse);
+			TelemetryScope scope("substep");
+			advanceSubstep(stepTime);
 		}
 	}
 
-	int particleCount()
+	// Calculates the velocity change of every particle for one substep from the current particle state, and leaves it in
+	// the velocityChange of the particles. The particles may be reordered, see ParticleStore::id.
+	void simulateSubstep(double dt)
 	{
-		return particles.size();
+		runSubstep(dt, false);
+	}
+
+	// Like simulateSubstep(), and integrates the velocity changes and gravity in the same pass that calculates them. The
+	// particles are reflected at the bounds and pushed out of the static geometry, see integrateParticle().
+	void advanceSubstep(double dt)
+	{
+		runSubstep(dt, true);
+	}
+
+	// Runs one substep on a copy of the particle state of another processor, possibly of another precision, without
+	// reordering or observing it. The result is left in the velocityChange of the particles.
+	template <typename OtherReal>
+	void simulateSubstep(const ParticleStore<OtherReal>& source, double dt)
+	{
+		while (particles.size() < source.size())
+		{
+			particles.add();
+		}
+		assert(particles.size() == source.size());
+
+		particles.pos.assign(source.pos);
+		particles.vel.assign(source.vel);
+		verletRebuildRequired = true; // The source may have been reordered since the last substep.
+		gridRebuildRequired = true;
+
+		calculateNeighbors();
+		calculateForces(dt);
+		calculateVelocityChanges(dt, false);
 	}
 
 protected:
-	PhysicsBody *a, *b; // Fake bodies.
-	std::vector<Particle> particles;
+	SphParameters params;
+	KernelConstants kernelConstants;
+	ParticleStore<Real> particles;
+	Rect bounds;
 	std::vector<int> boundaryParticles;
-	std::unique_ptr<SpatialGrid> grid;
+	std::unique_ptr<SpatialGrid<Real>> grid;
+	RigidBoundary<Real> rigidBoundary;
+	std::unique_ptr<SpatialGrid<Real>> boundaryGrid; // Of the samples of rigidBoundary.
+	NeighborList<Real> boundaryNeighbors; // Samples around every particle, valid while rigidBoundary has samples.
+	ReverseNeighborList boundaryNeighborsOf; // Entries of boundaryNeighbors by sample.
+	Vec2Array<Real> boundaryPairForces; // Force of every entry of boundaryNeighbors on its sample.
+	DistanceField<Real> staticField; // Of the static geometry, empty until buildStaticBoundary().
 	double defaultMass;
+	int substepsSinceReorder = 0;
+	std::vector<int> reorderOrder, reorderNewIndex;
+	NeighborList<Real> verletCandidates;
+	Vec2Array<Real> verletBuildPos; // Particle positions when verletCandidates was built.
+	bool verletRebuildRequired = true;
+	bool gridRebuildRequired = true;
+	NeighborList<Real> halfNeighbors; // Every pair of the neighbor list once, on the particle with the lower index.
+	ReverseNeighborList halfNeighborsOf; // Entries of halfNeighbors by neighbor.
+	Vec2Array<Real> pairForces; // Force of every entry of halfNeighbors on the particle with the lower index.
+	Vec2Array<Real> integratedVel; // New velocities of calculateVelocityChanges() while it integrates.
+	SubstepObserver<Real>* substepObserver = nullptr;
+	double lastSubstepTime = 0; // Of the velocity changes of the particles.
 
 	friend class MetaballRenderer;
 
-	const std::vector<Particle>& getParticles() const
+	void runSubstep(double dt, bool integrateParticles)
 	{
-		return particles;
+		lastSubstepTime = dt;
+		reorderParticles();
+		if (substepObserver)
+			substepObserver->substepStarted(particles, dt);
+		calculateNeighbors();
+		calculateForces(dt);
+		calculateVelocityChanges(dt, integrateParticles);
+		if (substepObserver)
+			substepObserver->substepFinished(particles);
 	}
 
 	void calculateNeighbors()
 	{
-		grid->initializeGrid(particles);
-		grid->calculateNeighbors();
+		{
+			PhaseTimer timer(PhaseGrid);
+			if (params.verletSkin <= 0)
+			{
+				updateGrid();
+			}
+			else if (isVerletRebuildRequired())
+			{
+				updateGrid();
+				grid->calculateVerletCandidates(verletCandidates, params.verletSkin);
+				verletBuildPos = particles.pos;
+				verletRebuildRequired = false;
+			}
+		}
+
+		PhaseTimer timer(PhaseNeighbors);
+		if (params.verletSkin > 0)
+		{
+			grid->calculateNeighborsFromCandidates(verletCandidates);
+		}
+		else
+		{
+			grid->calculateNeighbors();
+		}
+
+		if (USE_HALF_PAIR_FORCES)
+		{
+			grid->calculateHalfNeighbors(halfNeighbors);
+			halfNeighborsOf.build(halfNeighbors, particles.size());
+		}
 
-		t_avgNeighbor = 0;
-		for (Particle& p1 : particles)
+		if (rigidBoundary.size() > 0)
 		{
-			t_avgNeighbor += p1.neighbors.size();
+			calculateBoundaryNeighbors();
 		}
 
-		t_avgNeighbor /= particles.size();
+		Telemetry::getInstance().addCounter(CounterNeighborPairs, particles.neighbors.pairCount());
 	}
 
-	void calculateDensity()
+	// Rebuilds the grid whenever the particle indices may have changed, and otherwise lets it move only the particles that
+	// changed their cell, see SpatialGrid::updateGrid().
+	void updateGrid()
 	{
-		double mass = getDefaultMass();
+		if (gridRebuildRequired)
+		{
+			grid->initializeGrid(particles);
+			gridRebuildRequired = false;
+		}
+		else
+		{
+			grid->updateGrid();
+		}
+	}
 
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-		for (int i = 0; i < particles.size(); i++)
+	// The samples move with their bodies, so their grid, their volumes and the samples around the particles are all
+	// rebuilt every substep.
+	void calculateBoundaryNeighbors()
+	{
+		boundaryGrid->initializeGrid(rigidBoundary.samples);
+		boundaryGrid->calculateNeighbors();
+		rigidBoundary.calculateVolumes(kernelConstants, particles.restDensity);
+		boundaryGrid->calculateNeighborsOf(particles, boundaryNeighbors);
+		boundaryNeighborsOf.build(boundaryNeighbors, rigidBoundary.size());
+	}
+
+	// Density a flat wall at distance d adds to a particle. The wall counts as fluid at rest in rows of the rest spacing,
+	// the first half a spacing behind its surface, so a particle at rest sits half a spacing off the wall.
+	double calculateWallDensity(double d) const
+	{
+		double spacing = sqrt(params.getArea());
+		double range = kernelConstants.range;
+		int columns = (int)(range / spacing);
+		double density = 0;
+		for (double ry = d + spacing / 2; ry < range; ry += spacing)
 		{
-			Particle& p = particles[i];
-			// Calculate density.
-			p.density = wFuncP6(Vec2::ZERO);
-			for (auto& n : p.neighbors)
+			if (ry <= -range)
+				continue;
+
+			for (int column = -columns; column <= columns; column++)
 			{
-				p.density += wFuncP6(p.pos - n.p->pos);
-				assert(wFuncP6(n) == wFuncP6(n.r));
-				assert(std::isfinite(p.density) && p.density != 0);
+				double rx = column * spacing;
+				density += wFuncP6(rx * rx + ry * ry, kernelConstants);
 			}
+		}
+		return density * params.getMass();
+	}
 
-			p.density *= mass;
-			p.densityInv = 1.0 / p.density;
+	// Gradient of the density of the static geometry at particle i, false without static geometry.
+	bool getStaticBoundaryGradient(int i, Real& gradX, Real& gradY) const
+	{
+		if (staticField.isEmpty())
+			return false;
+
+		staticField.sampleDensity(particles.pos.x[i], particles.pos.y[i], gradX, gradY);
+		return true;
+	}
+
+	// Density of the static geometry and the boundary samples around particle i at pos[i], sum(psi_b W_ib) for the samples.
+	Real calculateBoundaryDensity(int i, const Vec2Array<Real>& pos) const
+	{
+		Real density = 0;
+		if (!staticField.isEmpty())
+		{
+			Real gradX, gradY;
+			density += staticField.sampleDensity(pos.x[i], pos.y[i], gradX, gradY);
+		}
+
+		if (rigidBoundary.size() == 0)
+			return density;
+
+		const Vec2Array<Real>& samplePos = rigidBoundary.samples.pos;
+		for (auto& n : boundaryNeighbors[i])
+		{
+			Real dx = pos.x[i] - samplePos.x[n.j];
+			Real dy = pos.y[i] - samplePos.y[n.j];
+			density += rigidBoundary.psi[n.j] * wFuncP6(dx * dx + dy * dy, kernelConstants);
 		}
+		return density;
 	}
 
-	void calculatePressure()
+	// The boundary samples push particle i with -m psi_b k_i grad W_ib, where k_i = pressureOverDensitySq(i) is p_i / rho_i^2
+	// or its equivalent in the solver, and the static geometry with -m k_i grad(rho_static) of its density field. Adds
+	// these forces to forces unless it is null, and sets the opposite forces on the samples and their bodies. The force of
+	// every pair is kept and gathered per sample afterwards, in the order of boundaryNeighborsOf.
+	template <typename PressureOverDensitySq, typename Policy>
+	void calculateBoundaryForces(PressureOverDensitySq pressureOverDensitySq, Vec2Array<Real>* forces, const Policy& policy)
 	{
-		for (Particle& ps : particles)
+		Real mass = (Real)getDefaultMass();
+		if (forces && !staticField.isEmpty())
 		{
-			ps.pressure = gasConstant * (ps.density - restDensity);
-			assert(std::isfinite(ps.pressure));
+			parallelFor(particles.size(), [&](int i)
+			{
+				Real gradX, gradY;
+				getStaticBoundaryGradient(i, gradX, gradY);
+				Real c = -mass * std::max(pressureOverDensitySq(i), (Real)0);
+				forces->add(i, c * gradX, c * gradY);
+			});
 		}
+
+		int sampleCount = rigidBoundary.size();
+		if (sampleCount == 0)
+			return;
+
+		boundaryPairForces.x.resize(boundaryNeighbors.pairCount());
+		boundaryPairForces.y.resize(boundaryNeighbors.pairCount());
+
+		parallelFor(particles.size(), [&](int i)
+		{
+			Real k = std::max(pressureOverDensitySq(i), (Real)0); // Walls only push.
+			Real forceX = 0;
+			Real forceY = 0;
+			for (int e = boundaryNeighbors.offsets[i]; e < boundaryNeighbors.offsets[i + 1]; e++)
+			{
+				const Neighbor<Real>& n = boundaryNeighbors.entries[e];
+				Real c = -mass * rigidBoundary.psi[n.j] * k * pressureGradient(n, kernelConstants, policy);
+				forceX += c * n.rx;
+				forceY += c * n.ry;
+				boundaryPairForces.set(e, c * n.rx, c * n.ry);
+			}
+
+			if (forces)
+			{
+				forces->add(i, forceX, forceY);
+			}
+		});
+
+		parallelFor(sampleCount, [&](int b)
+		{
+			Real fx = 0;
+			Real fy = 0;
+			for (int k = boundaryNeighborsOf.offsets[b]; k < boundaryNeighborsOf.offsets[b + 1]; k++)
+			{
+				int e = boundaryNeighborsOf.entries[k];
+				fx -= boundaryPairForces.x[e];
+				fy -= boundaryPairForces.y[e];
+			}
+			rigidBoundary.force.set(b, fx, fy);
+		});
+
+		rigidBoundary.sumBodyForces();
+	}
+
+	// Reduces the largest speed and the largest acceleration of the particles. The acceleration is the one of the last
+	// substep plus gravity.
+	void calculateMaxSpeedAndAcceleration(double& maxSpeed, double& maxAcceleration)
+	{
+		const Vec2Array<Real>& vel = particles.vel;
+		const Vec2Array<Real>& velocityChange = particles.velocityChange;
+		Real dtInv = lastSubstepTime > 0 ? (Real)(1 / lastSubstepTime) : 0;
+		Real gravity = (Real)params.gravity;
+		typedef std::pair<Real, Real> SpeedAndAccelerationSq;
+
+		SpeedAndAccelerationSq maxima = parallelReduce(particles.size(), SpeedAndAccelerationSq(0, gravity * gravity),
+			[&](int begin, int end, SpeedAndAccelerationSq& chunkMaxima)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				chunkMaxima.first = std::max(chunkMaxima.first, vel.x[i] * vel.x[i] + vel.y[i] * vel.y[i]);
+
+				Real ax = velocityChange.x[i] * dtInv;
+				Real ay = velocityChange.y[i] * dtInv + gravity;
+				chunkMaxima.second = std::max(chunkMaxima.second, ax * ax + ay * ay);
+			}
+		}, [](SpeedAndAccelerationSq& maxima, const SpeedAndAccelerationSq& chunkMaxima)
+		{
+			maxima.first = std::max(maxima.first, chunkMaxima.first);
+			maxima.second = std::max(maxima.second, chunkMaxima.second);
+		});
+
+		maxSpeed = std::sqrt((double)maxima.first);
+		maxAcceleration = std::sqrt((double)maxima.second);
 	}
 
-	void calculateNormalAndColorFieldLaplacian()
+	// The Verlet list stays valid while no particle has moved more than half the skin since it was built, because no pair
+	// can then have closed the skin distance.
+	bool isVerletRebuildRequired()
 	{
-		double mass = getDefaultMass();
+		if (verletRebuildRequired || verletBuildPos.size() != particles.size())
+			return true;
 
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-		for (int i = 0; i < particles.size(); i++)
+		Real maxDisplacementSq = parallelReduce(particles.size(), (Real)0, [this](int begin, int end, Real& chunkMax)
 		{
-			Particle& p = particles[i];
-			p.lap_cs = p.densityInv * wLaplacianFuncP6(Vec2::ZERO);
-			p.surfaceNormal = p.densityInv * wGradientFuncP6(Vec2::ZERO);
-			for (auto& n : p.neighbors)
+			for (int i = begin; i < end; i++)
 			{
-				p.lap_cs += n.p->densityInv * wLaplacianFuncP6(n);
-				assert(wLaplacianFuncP6(n) == wLaplacianFuncP6(n.r));
-				p.surfaceNormal += n.p->densityInv * wGradientFuncP6(n);
-				assert(wGradientFuncP6(n) == wGradientFuncP6(n.r));
+				Real dx = particles.pos.x[i] - verletBuildPos.x[i];
+				Real dy = particles.pos.y[i] - verletBuildPos.y[i];
+				chunkMax = std::max(chunkMax, dx * dx + dy * dy);
 			}
+		}, [](Real& maxSq, const Real& chunkMax) { maxSq = std::max(maxSq, chunkMax); });
 
-			p.lap_cs *= mass;
-			p.surfaceNormal *= mass;
-			p.surfaceNormalLen = p.surfaceNormal.length();
+		return maxDisplacementSq > params.verletSkin * params.verletSkin / 4;
+	}
+
+	// Periodically sorts the particle store in Z-order so that neighbor loops follow spatial locality.
+	void reorderParticles()
+	{
+		if (params.mortonReorderInterval <= 0 || ++substepsSinceReorder < params.mortonReorderInterval)
+			return;
+
+		PhaseTimer timer(PhaseReorder);
+		substepsSinceReorder = 0;
+		grid->calculateMortonOrder(particles, reorderOrder);
+		particles.reorder(reorderOrder, reorderNewIndex);
+
+		for (int& i : boundaryParticles)
+		{
+			i = reorderNewIndex[i];
 		}
+		std::sort(boundaryParticles.begin(), boundaryParticles.end());
+		verletRebuildRequired = true;
+		gridRebuildRequired = true;
+	}
+
+	void calculateDensity()
+	{
+		calculateDensity([](int) {});
+	}
+
+	// Calculates the density of every particle and calls finish(i) as soon as it is known, so work that only needs the
+	// density of the particle itself runs in the same pass.
+	template <typename Finish>
+	void calculateDensity(Finish finish)
+	{
+		PhaseTimer timer(PhaseDensity);
+		Real mass = (Real)getDefaultMass();
+		const KernelBatchFunctions<Real>& kernels = getKernelBatchFunctions<Real>();
+
+		parallelFor(particles.size(), [&](int i)
+		{
+			// Calculate density.
+			Real density = wFuncP6<Real>(0, kernelConstants);
+			Real w[KERNEL_BATCH_SIZE];
+			forEachNeighborBatch(particles.neighbors[i], [&](const NeighborBatch<Real>& batch)
+			{
+				kernels.wFuncP6(kernelConstants, batch.rLenSq, batch.q, batch.count, w);
+				for (int k = 0; k < batch.count; k++)
+				{
+					density += w[k];
+				}
+			});
+			assert(std::isfinite(density) && density != 0);
+
+			density = density * mass + calculateBoundaryDensity(i, particles.pos);
+			particles.density[i] = density;
+			particles.densityInv[i] = 1 / density;
+			finish(i);
+		});
+	}
+
+	void calculatePressure(int i)
+	{
+		particles.pressure[i] = (Real)params.gasConstant * (particles.density[i] - (Real)params.restDensity);
+		assert(std::isfinite(particles.pressure[i]));
+	}
+
+	// Calculates the surface normals and color field Laplacians together with the viscosity forces and the surface tension
+	// forces of the original SPH paper, which only need the densities and the normal of the particle itself, in a single
+	// sweep over the neighbors. The cohesion and curvature surface tension reads the normals of the neighbors and takes a
+	// pass of its own.
+	template <typename Policy>
+	void calculateNormalsAndForces(const Policy& policy)
+	{
+		Real mass = (Real)getDefaultMass();
+		Real viscosityScale = mass * (Real)params.viscosity;
+		const std::vector<Real>& densityInv = particles.densityInv;
+		const Vec2Array<Real>& vel = particles.vel;
+		const KernelBatchFunctions<Real>& kernels = getKernelBatchFunctions<Real>();
+
+		parallelFor(particles.size(), [&](int i)
+		{
+			Real lap_cs = densityInv[i] * wLaplacianFuncP6<Real>(0, kernelConstants);
+			Real normalX = 0;
+			Real normalY = 0;
+			Real viscosityX = 0;
+			Real viscosityY = 0;
+			Real lap[KERNEL_BATCH_SIZE];
+			Real grad[KERNEL_BATCH_SIZE];
+			Real viscosity[KERNEL_BATCH_SIZE];
+			forEachNeighborBatch(particles.neighbors[i], [&](const NeighborBatch<Real>& batch)
+			{
+				kernels.wLaplacianFuncP6(kernelConstants, batch.rLenSq, batch.q, batch.count, lap);
+				kernels.wGradientFuncP6(kernelConstants, batch.rLenSq, batch.q, batch.count, grad);
+				if (Policy::viscosity)
+				{
+					kernels.wLaplacianFunc(kernelConstants, batch.rLenSq, batch.q, batch.count, viscosity);
+				}
+				for (int k = 0; k < batch.count; k++)
+				{
+					const Neighbor<Real>& n = batch.neighbors[k];
+					Real rho_j_inv = densityInv[n.j];
+					lap_cs += rho_j_inv * lap[k];
+					normalX += rho_j_inv * grad[k] * n.rx;
+					normalY += rho_j_inv * grad[k] * n.ry;
+					if (Policy::viscosity)
+					{
+						Real c = viscosity[k] * rho_j_inv;
+						viscosityX += c * (vel.x[n.j] - vel.x[i]);
+						viscosityY += c * (vel.y[n.j] - vel.y[i]);
+					}
+				}
+			});
+
+			particles.lap_cs[i] = lap_cs * mass;
+			particles.surfaceNormal.set(i, normalX * mass, normalY * mass);
+			particles.surfaceNormalLen[i] = particles.surfaceNormal.getLength(i);
+
+			if (Policy::viscosity)
+			{
+				assert(std::isfinite(viscosityX) && std::isfinite(viscosityY));
+				particles.forceViscosity.set(i, viscosityX * viscosityScale, viscosityY * viscosityScale);
+			}
+			if (Policy::surfaceTension != SurfaceTensionType::CohesionAndCurvature)
+			{
+				calculateSurfaceTensionForce(i);
+			}
+		});
 
 		boundaryParticles.clear();
 		for (int i = 0; i < particles.size(); i++)
 		{
-			Particle& p = particles[i];
-			if (p.surfaceNormalLen > boundaryThreshold)
+			if (particles.surfaceNormalLen[i] > (Real)params.boundaryThreshold)
 			{
 				boundaryParticles.push_back(i);
 			}
 		}
+
+		if (Policy::surfaceTension == SurfaceTensionType::CohesionAndCurvature)
+		{
+			calculateSurfaceTensionForces(policy);
+		}
 	}
 
 	// Calculate surface tension by estimating surface curvature from the original SPH paper.
-	void calculateSurfaceTensionForce(Particle& p)
+	void calculateSurfaceTensionForce(int i)
 	{
-		double mass = getDefaultMass();
-
-		p.forceSurface = Vec2::ZERO;
+		Real forceX = 0;
+		Real forceY = 0;
 
-		if (p.surfaceNormalLen > boundaryThreshold)
+		Real surfaceNormalLen = particles.surfaceNormalLen[i];
+		if (surfaceNormalLen > (Real)params.boundaryThreshold)
 		{
-			p.forceSurface = -surfaceTension * p.lap_cs * p.surfaceNormal / p.surfaceNormalLen;
+			Real c = -(Real)params.surfaceTension * particles.lap_cs[i] / surfaceNormalLen;
+			forceX = c * particles.surfaceNormal.x[i];
+			forceY = c * particles.surfaceNormal.y[i];
 		}
 
-		assert(std::isfinite(p.forceSurface.x) && std::isfinite(p.forceSurface.y));
+		assert(std::isfinite(forceX) && std::isfinite(forceY));
+		particles.forceSurface.set(i, forceX, forceY);
 	}
 
 	// Calculate surface tension force based on "Versatile Surface Tension and Adhesion for SPH Fluids"
 	// Make sure particle normals have been calculated before calling this method!
 	// Note adhesion and curvature terms are applied to all particles.
-	void calculateSurfaceTensionForce2(Particle& p)
+	void calculateSurfaceTensionForce2(int i)
 	{
-		double mass = getDefaultMass();
+		Real mass = (Real)getDefaultMass();
+		const std::vector<Real>& densityInv = particles.densityInv;
+		const Vec2Array<Real>& surfaceNormal = particles.surfaceNormal;
 
-		p.forceSurface = Vec2::ZERO;
-
-		Vec2 forceCohesion = Vec2::ZERO;
-		Vec2 forceCurvature = Vec2::ZERO;
+		Real forceX = 0;
+		Real forceY = 0;
 		//for (auto& n : p.neighbors)
 		//{
-		//	forceCohesion = -SurfaceTensionConst2 * mass * mass * surfaceTensionCohesionKernel(n) * n.r.getNormalized();
+		//	forceCohesion = -SurfaceTensionConst2 * mass * mass * surfaceTensionCohesionKernel(n, kernelConstants) * n.r.getNormalized();
 		//	forceCurvature = -SurfaceTensionConst2 * range * mass * (p.surfaceNormal - n.p->surfaceNormal);
 		//	p.forceSurface += 2 * restDensity / (p.density + n.p->density) * (forceCohesion + forceCurvature);
 		//}
-		for (auto& n : p.neighbors)
+		for (auto& n : particles.neighbors[i])
 		{
-			forceCohesion =  mass * surfaceTensionCohesionKernel(n) * n.r.getNormalized();
-			forceCurvature = range * (p.surfaceNormal - n.p->surfaceNormal);
-			p.forceSurface += (p.densityInv + n.p->densityInv) * (forceCohesion + forceCurvature);
+			Real rLen = n.q * (Real)kernelConstants.range;
+			Real c = rLen > 0 ? mass * surfaceTensionCohesionKernel(n, kernelConstants) / rLen : 0; // Cohesion along the normalized r.
+			Real s = densityInv[i] + densityInv[n.j];
+			forceX += s * (c * n.rx + (Real)kernelConstants.range * (surfaceNormal.x[i] - surfaceNormal.x[n.j]));
+			forceY += s * (c * n.ry + (Real)kernelConstants.range * (surfaceNormal.y[i] - surfaceNormal.y[n.j]));
 		}
-		p.forceSurface *= 2 * restDensity * (-SurfaceTensionConst2) * mass;
+		Real scale = (Real)(2 * params.restDensity * (-params.surfaceTensionConst2)) * mass;
+		forceX *= scale;
+		forceY *= scale;
 
-		assert(std::isfinite(p.forceSurface.x) && std::isfinite(p.forceSurface.y));
+		assert(std::isfinite(forceX) && std::isfinite(forceY));
+		particles.forceSurface.set(i, forceX, forceY);
 	}
 
-	void calculatePressureForce(Particle& p)
+	// The cohesion and curvature terms are antisymmetric in i and j, so each pair of the half list is evaluated once.
+	void calculateSurfaceTensionForce2Pairs()
 	{
-		p.forcePressure = Vec2::ZERO;
-		double mass = getDefaultMass();
+		Real mass = (Real)getDefaultMass();
+		Real scale = (Real)(2 * params.restDensity * (-params.surfaceTensionConst2)) * mass;
+		const std::vector<Real>& densityInv = particles.densityInv;
+		const Vec2Array<Real>& surfaceNormal = particles.surfaceNormal;
+		const KernelBatchFunctions<Real>& kernels = getKernelBatchFunctions<Real>();
 
-		for (auto& n : p.neighbors)
+		accumulatePairForces(particles.forceSurface, [&](int i, const NeighborBatch<Real>& batch, Real* fx, Real* fy)
 		{
-			const Particle& pj = *n.p;
-			assert(&pj != &p);
-			double p_s = p.pressure;
-			double p_j = pj.pressure;
-			double rho_j_inv = pj.densityInv;
-			double rho_s_inv = p.densityInv;
-			Vec2& r = n.r;
-
-			Vec2 wGradient = wGradientFuncSpiky(n);
-			assert(wGradientFuncSpiky(n) == wGradientFuncSpiky(n.r));
-			p.forcePressure += pressureForce2(mass, p_s, p_j, rho_s_inv, rho_j_inv, wGradient);
-		}
-
-		assert(std::isfinite(p.forcePressure.x) && std::isfinite(p.forcePressure.y));
+			Real cohesion[KERNEL_BATCH_SIZE];
+			kernels.surfaceTensionCohesionKernel(kernelConstants, batch.rLenSq, batch.q, batch.count, cohesion);
+			for (int k = 0; k < batch.count; k++)
+			{
+				const Neighbor<Real>& n = batch.neighbors[k];
+				Real rLen = n.q * (Real)kernelConstants.range;
+				Real c = rLen > 0 ? mass * cohesion[k] / rLen : 0; // Cohesion along the normalized r.
+				Real s = scale * (densityInv[i] + densityInv[n.j]);
+				fx[k] = s * (c * n.rx + (Real)kernelConstants.range * (surfaceNormal.x[i] - surfaceNormal.x[n.j]));
+				fy[k] = s * (c * n.ry + (Real)kernelConstants.range * (surfaceNormal.y[i] - surfaceNormal.y[n.j]));
+			}
+		});
 	}
 
-	void calculatePressureForceWithPos(Particle& p)
+	template <typename Policy>
+	void calculateSurfaceTensionForces(const Policy&)
 	{
-		p.forcePressure = Vec2::ZERO;
-		double mass = getDefaultMass();
-
-		for (auto& n : p.neighbors)
+		if (Policy::surfaceTension == SurfaceTensionType::CohesionAndCurvature && USE_HALF_PAIR_FORCES)
 		{
-			const Particle& pj = *n.p;
-			assert(&pj != &p);
-			double p_s = p.pressure;
-			double p_j = pj.pressure;
-			double rho_j_inv = pj.densityInv;
-			double rho_s_inv = p.densityInv;
-			Vec2 r = p.pos - pj.pos;
-
-			Vec2 wGradient = wGradientFuncSpiky(r);
-			p.forcePressure += pressureForce2(mass, p_s, p_j, rho_s_inv, rho_j_inv, wGradient);
+			calculateSurfaceTensionForce2Pairs();
+			return;
 		}
 
-		assert(std::isfinite(p.forcePressure.x) && std::isfinite(p.forcePressure.y));
+		parallelFor(particles.size(), [&](int i)
+		{
+			if (Policy::surfaceTension == SurfaceTensionType::CohesionAndCurvature)
+			{
+				calculateSurfaceTensionForce2(i);
+			}
+			else
+			{
+				calculateSurfaceTensionForce(i);
+			}
+		});
 	}
 
-	// From SPH 03'
-	static inline Vec2 pressureForce1(double mass, double pi, double pj, double rho_i_inv, double rho_j_inv, Vec2 wgrad)
+	// Gradient of the pressure kernel family of the policy, see KernelFunctions.h.
+	template <typename Policy>
+	static Real pressureGradient(const Neighbor<Real>& n, const KernelConstants& kc, const Policy&)
 	{
-		return (-mass * (pi + pj) / 2 * rho_j_inv) * wgrad;
+		return Policy::pressureKernel == SpikyKernel ? wGradientFuncSpiky(n, kc) : wGradientFuncP6(n, kc);
 	}
 
-	// From PCISPH
-	static inline Vec2 pressureForce2(double mass, double pi, double pj, double rho_i_inv, double rho_j_inv, Vec2 wgrad)
+	template <typename Policy>
+	static typename KernelBatchFunctions<Real>::Func getPressureGradientBatch(const KernelBatchFunctions<Real>& kernels, const Policy&)
 	{
-		return (-mass * mass * (pi * rho_i_inv * rho_i_inv + pj * rho_j_inv * rho_j_inv)) * wgrad;
+		return Policy::pressureKernel == SpikyKernel ? kernels.wGradientFuncSpiky : kernels.wGradientFuncP6;
 	}
 
-	// From SPH survivial kit
-	static inline Vec2 pressureForce3(double mass, double pi, double pj, double rho_i_inv, double rho_j_inv, Vec2 wgrad)
+	template <typename Policy>
+	void calculatePressureForce(int i, const Policy& policy)
 	{
-		return (-mass * (pi + pj) / 2 * rho_i_inv * rho_j_inv) * wgrad;
-	}
+		Real forceX = 0;
+		Real forceY = 0;
+		Real mass = (Real)getDefaultMass();
+		const std::vector<Real>& pressure = particles.pressure;
+		const std::vector<Real>& densityInv = particles.densityInv;
 
-	void calculateViscosityForce(Particle& p)
-	{
-		if (viscosity == 0)
-			return;
+		for (auto& n : particles.neighbors[i])
+		{
+			assert(n.j != i);
+			Real p_s = pressure[i];
+			Real p_j = pressure[n.j];
+			Real rho_j_inv = densityInv[n.j];
+			Real rho_s_inv = densityInv[i];
+
+			Real c = pressureForce2(mass, p_s, p_j, rho_s_inv, rho_j_inv, pressureGradient(n, kernelConstants, policy));
+			forceX += c * n.rx;
+			forceY += c * n.ry;
+		}
 
-		p.forceViscosity = Vec2::ZERO;
-		double mass = getDefaultMass();
+		assert(std::isfinite(forceX) && std::isfinite(forceY));
+		particles.forcePressure.set(i, forceX, forceY);
+	}
 
-		for (auto& n : p.neighbors)
+	template <typename Policy>
+	void calculatePressureForceWithPos(int i, const Policy& policy)
+	{
+		Real forceX = 0;
+		Real forceY = 0;
+		Real mass = (Real)getDefaultMass();
+		const std::vector<Real>& pressure = particles.pressure;
+		const std::vector<Real>& densityInv = particles.densityInv;
+		const Vec2Array<Real>& pos = particles.pos;
+		Real rangeInv = (Real)(1 / kernelConstants.range);
+
+		for (auto& neighbor : particles.neighbors[i])
 		{
-			const Particle& pj = *n.p;
-			assert(&pj != &p);
-			double p_s = p.pressure;
-			double p_j = pj.pressure;
-			double rho_j_inv = pj.densityInv;
-			double rho_s_inv = p.densityInv;
-			Vec2& r = n.r;
-
-			double wLap = wLaplacianFunc(n);
-			assert(wLaplacianFunc(n) == wLaplacianFunc(n.r));
-			p.forceViscosity += wLap * (pj.body->getVelocity() - p.body->getVelocity()) * rho_j_inv;
+			assert(neighbor.j != i);
+			Neighbor<Real> n(neighbor.j, pos.x[i] - pos.x[neighbor.j], pos.y[i] - pos.y[neighbor.j], rangeInv);
+			Real p_s = pressure[i];
+			Real p_j = pressure[n.j];
+			Real rho_j_inv = densityInv[n.j];
+			Real rho_s_inv = densityInv[i];
+
+			Real c = pressureForce2(mass, p_s, p_j, rho_s_inv, rho_j_inv, pressureGradient(n, kernelConstants, policy));
+			forceX += c * n.rx;
+			forceY += c * n.ry;
 		}
 
-		p.forceViscosity *= mass * viscosity;
-
-		assert(std::isfinite(p.forceViscosity.x) && std::isfinite(p.forceViscosity.y));
+		assert(std::isfinite(forceX) && std::isfinite(forceY));
+		particles.forcePressure.set(i, forceX, forceY);
 	}
 
-	virtual void calculateForces(double dt)
+	// The PCISPH pressure force is antisymmetric in i and j, so each pair of the half list is evaluated once.
+	template <typename Policy>
+	void calculatePressureForcePairs(const Policy& policy)
 	{
-		double mass = getDefaultMass();
+		Real mass = (Real)getDefaultMass();
+		const std::vector<Real>& pressure = particles.pressure;
+		const std::vector<Real>& densityInv = particles.densityInv;
+		typename KernelBatchFunctions<Real>::Func pressureGradientBatch = getPressureGradientBatch(getKernelBatchFunctions<Real>(), policy);
 
-		calculateDensity();
-		calculatePressure();
-		calculateNormalAndColorFieldLaplacian();
-
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-		for (int i = 0; i < particles.size(); i++)
+		accumulatePairForces(particles.forcePressure, [&](int i, const NeighborBatch<Real>& batch, Real* fx, Real* fy)
 		{
-			Particle& p = particles[i];
-			if (surfaceTensionType == SurfaceTensionType::CohesionAndCurvature)
+			Real gradient[KERNEL_BATCH_SIZE];
+			pressureGradientBatch(kernelConstants, batch.rLenSq, batch.q, batch.count, gradient);
+			Real p_s = pressure[i] * densityInv[i] * densityInv[i];
+			for (int k = 0; k < batch.count; k++)
 			{
-				calculateSurfaceTensionForce2(p);
+				// pressureForce2 with the kernel gradient c * r.
+				const Neighbor<Real>& n = batch.neighbors[k];
+				Real p_j = pressure[n.j] * densityInv[n.j] * densityInv[n.j];
+				Real c = -mass * mass * (p_s + p_j) * gradient[k];
+				fx[k] = c * n.rx;
+				fy[k] = c * n.ry;
 			}
-			else
-			{
-				calculateSurfaceTensionForce(p);
-			}
-			calculatePressureForce(p);
-			calculateViscosityForce(p);
-		}
+		});
 	}
 
-	virtual void applyForces(double dt)
+	// Calls calculatePairForces(i, batch, fx, fy) for the half list of every particle i, one batch of neighbors at a time, adding
+	// each pair force to particle i and subtracting it from the neighbor. The pair forces are kept per entry of the half
+	// list and gathered per particle afterwards, so no two workers write to the same particle and the sums are always
+	// taken in the same order.
+	template <typename PairForces>
+	void accumulatePairForces(Vec2Array<Real>& forces, PairForces calculatePairForces)
 	{
-		double mass = getDefaultMass();
+		int count = particles.size();
+		pairForces.x.resize(halfNeighbors.pairCount());
+		pairForces.y.resize(halfNeighbors.pairCount());
 
-		// Pressure force restrictions.
-		for (auto& p : particles)
+		parallelFor(count, [&](int i)
 		{
-			if (p.forcePressure.length() > maxPressureForce)
-				p.forcePressure.scale(maxPressureForce / p.forcePressure.length());
-		}
+			int e = halfNeighbors.offsets[i];
+			forEachNeighborBatch(halfNeighbors[i], [&](const NeighborBatch<Real>& batch)
+			{
+				calculatePairForces(i, batch, &pairForces.x[e], &pairForces.y[e]);
+				e += batch.count;
+			});
+		});
 
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-		for (int i = 0; i < particles.size(); i++)
+		parallelFor(count, [&](int i)
 		{
-			Particle& ps = particles[i];
-
-			Vec2 v = (ps.forcePressure + ps.forceViscosity + ps.forceSurface) / mass * dt;
-			// Add XSPH artifitial viscosity. See "Ghost SPH"
-			Vec2 vXSPH = v;
-			for (auto& n : ps.neighbors)
+			Real fx = 0;
+			Real fy = 0;
+			for (int e = halfNeighbors.offsets[i]; e < halfNeighbors.offsets[i + 1]; e++)
 			{
-				const Particle& pj = *n.p;
-				vXSPH += (cXSPH * mass * pj.densityInv * wFuncP6(n)) * (pj.body->getVelocity() - ps.body->getVelocity()); // v_ij = v_j - v_i;
+				fx += pairForces.x[e];
+				fy += pairForces.y[e];
 			}
-			v = vXSPH;
-
-			ps.vel = ps.body->getVelocity() + v;
-			ps.body->applyImpulse(mass * v); // Apply impulse for chipmunk.
-			ps.pos += dt * ps.vel;
-		}
+			for (int k = halfNeighborsOf.offsets[i]; k < halfNeighborsOf.offsets[i + 1]; k++)
+			{
+				int e = halfNeighborsOf.entries[k];
+				fx -= pairForces.x[e];
+				fy -= pairForces.y[e];
+			}
+			forces.x[i] = fx;
+			forces.y[i] = fy;
+			assert(std::isfinite(fx) && std::isfinite(fy));
+		});
 	}
 
-	void cachePositions()
-	{
-		for (Particle& p : particles)
-		{
-			p.pos = p.body->getPosition();
-		}
-	}
+	// The pressure force functions take the scalar wgrad of the kernel gradient wgrad * r and return the scalar c of the pair
+	// force c * r.
 
-	virtual int getSubStepCount()
+	// From SPH 03'
+	static inline Real pressureForce1(Real mass, Real pi, Real pj, Real rho_i_inv, Real rho_j_inv, Real wgrad)
 	{
-		return substep;
+		return (-mass * (pi + pj) / 2 * rho_j_inv) * wgrad;
 	}
 
-	static void preSolve(cpConstraint *constraint, cpSpace *space)
+	// From PCISPH
+	static inline Real pressureForce2(Real mass, Real pi, Real pj, Real rho_i_inv, Real rho_j_inv, Real wgrad)
 	{
+		return (-mass * mass * (pi * rho_i_inv * rho_i_inv + pj * rho_j_inv * rho_j_inv)) * wgrad;
 	}
 
-	static void postSolve(cpConstraint *constraint, cpSpace *space)
+	// From SPH survivial kit
+	static inline Real pressureForce3(Real mass, Real pi, Real pj, Real rho_i_inv, Real rho_j_inv, Real wgrad)
 	{
+		return (-mass * (pi + pj) / 2 * rho_i_inv * rho_j_inv) * wgrad;
 	}
 
-	static void preStep(cpConstraint *constraint, cpFloat dt)
+	virtual void calculateForces(double dt) = 0;
+
+	// Turns the forces of the substep into the velocity change of every particle, with the pressure force clamped and XSPH
+	// artificial viscosity added. With integrateParticles the particles are integrated in the same pass. XSPH reads the
+	// velocities of the neighbors, so the new velocities go to integratedVel until the pass is done.
+	void calculateVelocityChanges(double dt, bool integrateParticles)
 	{
-		SPHProcessor* processor = (SPHProcessor*)constraint->data;
+		PhaseTimer timer(PhaseVelocityChange);
+		Real mass = (Real)getDefaultMass();
+		Real maxPressureForce = (Real)params.maxPressureForce;
+		Vec2Array<Real>& forcePressure = particles.forcePressure;
+		const std::vector<Real>& densityInv = particles.densityInv;
+		const Vec2Array<Real>& vel = particles.vel;
+		Real dtOverMass = (Real)dt / mass;
+
+		if (integrateParticles)
+		{
+			integratedVel.x.resize(particles.size());
+			integratedVel.y.resize(particles.size());
+		}
 
-		int substepCount = processor->getSubStepCount();
-		double stepTime = dt / substepCount;
+		parallelFor(particles.size(), [&](int i)
+		{
+			// Pressure force restrictions.
+			Real length = forcePressure.getLength(i);
+			if (length > maxPressureForce)
+			{
+				Real scale = maxPressureForce / length;
+				forcePressure.set(i, forcePressure.x[i] * scale, forcePressure.y[i] * scale);
+			}
 
-		timeval t1, t2;
-		gettimeofday(&t1, NULL);
+			Real vx = (forcePressure.x[i] + particles.forceViscosity.x[i] + particles.forceSurface.x[i]) * dtOverMass;
+			Real vy = (forcePressure.y[i] + particles.forceViscosity.y[i] + particles.forceSurface.y[i]) * dtOverMass;
+			// Add XSPH artifitial viscosity. See "Ghost SPH"
+			for (auto& n : particles.neighbors[i])
+			{
+				Real c = (Real)params.cXSPH * mass * densityInv[n.j] * wFuncP6(n, kernelConstants);
+				vx += c * (vel.x[n.j] - vel.x[i]); // v_ij = v_j - v_i;
+				vy += c * (vel.y[n.j] - vel.y[i]);
+			}
 
-		for (int it = 0; it < substepCount; it++)
+			particles.velocityChange.set(i, vx, vy);
+			if (integrateParticles)
+			{
+				integrateParticle(i, vx, vy, (Real)dt);
+			}
+		});
+
+		if (integrateParticles)
 		{
-			processor->cachePositions();
-			processor->calculateNeighbors();
-			processor->calculateForces(stepTime);
-			processor->applyForces(stepTime);
+			particles.vel.x.swap(integratedVel.x);
+			particles.vel.y.swap(integratedVel.y);
 		}
-
-		gettimeofday(&t2, NULL);
-		t_SphStepTime = microSecondOfTimeval(t2) - microSecondOfTimeval(t1);
 	}
 
-	static long microSecondOfTimeval(const timeval& t)
+	// Integrates the velocity change and gravity of particle i into its position and into integratedVel, and reflects it
+	// when it leaves the bounds. The neighbor list keeps the distances, so the position is updated in place.
+	void integrateParticle(int i, Real dvx, Real dvy, Real dt)
 	{
-		return t.tv_sec * 1000000 + t.tv_usec;
-	}
+		Real restitution = (Real)params.wallRestitution;
+		Real xl = bounds.getMinX(), xh = bounds.getMaxX(), yl = bounds.getMinY(), yh = bounds.getMaxY();
+
+		Real vx = particles.vel.x[i] + dvx;
+		Real vy = particles.vel.y[i] + dvy + (Real)params.gravity * dt;
+		Real px = particles.pos.x[i] + dt * vx;
+		Real py = particles.pos.y[i] + dt * vy;
+		if (px < xl || px > xh)
+		{
+			px = std::min(std::max(px, xl), xh);
+			vx *= -restitution;
+		}
+		if (py < yl || py > yh)
+		{
+			py = std::min(std::max(py, yl), yh);
+			vy *= -restitution;
+		}
+		if (!staticField.isEmpty())
+		{
+			resolveStaticPenetration(px, py, vx, vy, (Real)params.getContactRadius(), restitution);
+		}
 
-	static void applyCachedImpulseImpl(cpConstraint *constraint, cpFloat dt_coef)
-	{
+		particles.pos.set(i, px, py);
+		integratedVel.set(i, vx, vy);
 	}
 
-	static void applyImpulseImpl(cpConstraint *constraint, cpFloat dt)
+	// Pushes a particle closer than contactRadius to the static geometry back out along the distance gradient, and reflects
+	// its velocity towards the geometry like the bounds do.
+	void resolveStaticPenetration(Real& px, Real& py, Real& vx, Real& vy, Real contactRadius, Real restitution) const
 	{
-	}
+		Real normalX, normalY;
+		Real distance = staticField.sampleDistance(px, py, normalX, normalY);
+		Real normalLen = std::sqrt(normalX * normalX + normalY * normalY);
+		if (distance >= contactRadius || normalLen == 0)
+			return;
 
-	static cpFloat getImpulseImpl(cpConstraint *constraint)
-	{
-		return 0;
+		normalX /= normalLen;
+		normalY /= normalLen;
+		px += (contactRadius - distance) * normalX;
+		py += (contactRadius - distance) * normalY;
+
+		Real vn = vx * normalX + vy * normalY;
+		if (vn < 0)
+		{
+			vx -= (1 + restitution) * vn * normalX;
+			vy -= (1 + restitution) * vn * normalY;
+		}
 	}
 };
 
-#endif __SPHProcessor_H__
\ No newline at end of file
+#endif // __SPHProcessor_H__
\ No newline at end of file
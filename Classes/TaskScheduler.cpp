@@ -0,0 +1,186 @@
+#include "TaskScheduler.h"
+#include <algorithm>
+
+#ifdef _MSC_VER
+#define TASK_THREAD_LOCAL __declspec(thread)
+#else
+#define TASK_THREAD_LOCAL __thread
+#endif
+
+static TASK_THREAD_LOCAL int t_workerIndex = 0;
+static TASK_THREAD_LOCAL bool t_inLoop = false;
+
+TaskScheduler& TaskScheduler::getInstance()
+{
+	static TaskScheduler scheduler;
+	return scheduler;
+}
+
+TaskScheduler::TaskScheduler()
+	: activeWorkers(0)
+	, completedChunks(0)
+{
+	setThreadCount(THREAD_COUNT);
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	stopWorkers();
+}
+
+void TaskScheduler::setThreadCount(int threadCount)
+{
+	if (threadCount <= 0)
+	{
+		threadCount = std::max((int)std::thread::hardware_concurrency(), 1);
+	}
+
+	if (threadCount == getThreadCount() && runs)
+		return;
+
+	stopWorkers();
+	runs.reset(new ChunkRun[threadCount]);
+	startWorkers(threadCount - 1);
+}
+
+int TaskScheduler::getWorkerIndex()
+{
+	return t_workerIndex;
+}
+
+void TaskScheduler::startWorkers(int workerCount)
+{
+	stopping = false;
+	for (int index = 1; index <= workerCount; index++)
+	{
+		workers.push_back(std::thread(&TaskScheduler::workerLoop, this, index));
+	}
+}
+
+void TaskScheduler::stopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+	workers.clear();
+}
+
+void TaskScheduler::run(int count, int chunkSize, ChunkFunction function, const void* body)
+{
+	int chunkCount = (count + chunkSize - 1) / chunkSize;
+	if (workers.empty() || chunkCount <= 1 || t_inLoop)
+	{
+		for (int begin = 0; begin < count; begin += chunkSize)
+		{
+			function(body, begin, std::min(begin + chunkSize, count));
+		}
+		return;
+	}
+
+	// Deal the chunks out as one contiguous run per worker.
+	int threadCount = getThreadCount();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->function = function;
+		this->body = body;
+		this->count = count;
+		this->chunkSize = chunkSize;
+		for (int index = 0; index < threadCount; index++)
+		{
+			unsigned long long front = (long long)chunkCount * index / threadCount;
+			unsigned long long back = (long long)chunkCount * (index + 1) / threadCount;
+			runs[index].range.store(front | (back << 32));
+		}
+		completedChunks.store(0);
+		loopOpen = true;
+		generation++;
+	}
+	wakeUp.notify_all();
+
+	t_inLoop = true;
+	work(0);
+	t_inLoop = false;
+
+	while (completedChunks.load() < chunkCount)
+	{
+		std::this_thread::yield();
+	}
+
+	// No worker may join anymore, and the ones that did have to leave before the runs are dealt out again.
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		loopOpen = false;
+	}
+	while (activeWorkers.load() > 0)
+	{
+		std::this_thread::yield();
+	}
+}
+
+void TaskScheduler::workerLoop(int index)
+{
+	t_workerIndex = index;
+	t_inLoop = true;
+	int seenGeneration = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeUp.wait(lock, [&] { return stopping || generation != seenGeneration; });
+			if (stopping)
+				return;
+
+			seenGeneration = generation;
+			if (!loopOpen)
+				continue;
+
+			activeWorkers++;
+		}
+
+		work(index);
+		activeWorkers--;
+	}
+}
+
+// Runs the own chunks of the worker from the front, then steals from the back of the runs of the others.
+void TaskScheduler::work(int index)
+{
+	int threadCount = getThreadCount();
+	for (int k = 0; k < threadCount; k++)
+	{
+		int victim = (index + k) % threadCount;
+		int chunk;
+		while (takeChunk(runs[victim], k == 0, chunk))
+		{
+			int begin = chunk * chunkSize;
+			function(body, begin, std::min(begin + chunkSize, count));
+			completedChunks++;
+		}
+	}
+}
+
+bool TaskScheduler::takeChunk(ChunkRun& run, bool fromFront, int& chunk)
+{
+	unsigned long long range = run.range.load();
+	for (;;)
+	{
+		unsigned long long front = range & 0xffffffff;
+		unsigned long long back = range >> 32;
+		if (front >= back)
+			return false;
+
+		unsigned long long taken = fromFront ? (front + 1) | (back << 32) : front | ((back - 1) << 32);
+		if (run.range.compare_exchange_weak(range, taken))
+		{
+			chunk = (int)(fromFront ? front : back - 1);
+			return true;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,127 @@
+#ifndef __TaskScheduler_H__
+#define __TaskScheduler_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Constants.h"
+
+// A persistent pool of threads for the parallel loops of the solver. parallelFor() cuts an index range into chunks and
+// deals them out to the workers as contiguous runs, one run each, so with the particle store in Z-order every worker starts
+// on a compact block of grid cells. A worker that is done with its run steals chunks from the far end of the run of
+// another one, so dense regions do not leave threads idle. The calling thread works as worker 0, and the other workers
+// sleep between loops instead of spinning, so the pool does not compete with the main thread while it renders.
+class TaskScheduler
+{
+public:
+	static TaskScheduler& getInstance();
+
+	~TaskScheduler();
+
+	// Threads working on a loop including the calling one, 0 for one per core.
+	void setThreadCount(int threadCount);
+
+	int getThreadCount() const
+	{
+		return workers.size() + 1;
+	}
+
+	// Index of the worker running the calling code, below getThreadCount(). The calling thread is worker 0.
+	static int getWorkerIndex();
+
+	// Calls body(begin, end) for chunks of at most chunkSize indices covering [0, count), and returns once all chunks are
+	// done. A parallelFor() within a chunk runs on the calling worker alone.
+	template <typename Body>
+	void parallelFor(int count, int chunkSize, const Body& body)
+	{
+		run(count, chunkSize, &callBody<Body>, &body);
+	}
+
+protected:
+	typedef void (*ChunkFunction)(const void* body, int begin, int end);
+
+	// The chunks of a worker are front to back - 1, packed into one word so the worker and a thief can both take chunks
+	// with a single compare and swap. The padding keeps the runs of two workers off the same cache line.
+	struct ChunkRun
+	{
+		std::atomic<unsigned long long> range;
+		char padding[64 - sizeof(std::atomic<unsigned long long>)];
+	};
+
+	std::vector<std::thread> workers;
+	std::unique_ptr<ChunkRun[]> runs;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	int generation = 0; // Of the current loop, the workers wake up when it changes.
+	bool loopOpen = false; // Whether workers may still join the current loop.
+	bool stopping = false;
+	std::atomic<int> activeWorkers;
+	std::atomic<int> completedChunks;
+
+	// The current loop.
+	ChunkFunction function = nullptr;
+	const void* body = nullptr;
+	int count = 0;
+	int chunkSize = 1;
+
+	TaskScheduler();
+
+	template <typename Body>
+	static void callBody(const void* body, int begin, int end)
+	{
+		(*(const Body*)body)(begin, end);
+	}
+
+	void run(int count, int chunkSize, ChunkFunction function, const void* body);
+	void startWorkers(int workerCount);
+	void stopWorkers();
+	void workerLoop(int index);
+	void work(int index);
+	bool takeChunk(ChunkRun& run, bool fromFront, int& chunk);
+};
+
+// Calls body(i) for every i in [0, count) on the task scheduler, in chunks of TASK_CHUNK_SIZE.
+template <typename Body>
+inline void parallelFor(int count, const Body& body)
+{
+	TaskScheduler::getInstance().parallelFor(count, TASK_CHUNK_SIZE, [&body](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			body(i);
+		}
+	});
+}
+
+// Calls body(begin, end) for chunks of TASK_CHUNK_SIZE indices covering [0, count) on the task scheduler, for loops that
+// reduce within a chunk first.
+template <typename Body>
+inline void parallelForChunks(int count, const Body& body)
+{
+	TaskScheduler::getInstance().parallelFor(count, TASK_CHUNK_SIZE, body);
+}
+
+// Reduces [0, count) on the task scheduler. body(begin, end, partial) adds a chunk of TASK_CHUNK_SIZE indices to its own
+// partial, which starts out as init, and combine(result, partial) then adds the partials to the result in chunk order.
+// The chunks do not depend on the thread count or on which worker ran them, so neither does the result.
+template <typename T, typename Body, typename Combine>
+inline T parallelReduce(int count, const T& init, const Body& body, const Combine& combine)
+{
+	std::vector<T> partials((count + TASK_CHUNK_SIZE - 1) / TASK_CHUNK_SIZE, init);
+	TaskScheduler::getInstance().parallelFor(count, TASK_CHUNK_SIZE, [&](int begin, int end)
+	{
+		body(begin, end, partials[begin / TASK_CHUNK_SIZE]);
+	});
+
+	T result = init;
+	for (const T& partial : partials)
+	{
+		combine(result, partial);
+	}
+	return result;
+}
+
+#endif // __TaskScheduler_H__
\ No newline at end of file
@@ -0,0 +1,218 @@
+#include "Telemetry.h"
+#include <algorithm>
+#include <fstream>
+
+double t_velocityDrift = 0;
+double t_densityDrift = 0;
+
+const char* const t_phaseNames[SphPhaseCount] =
+{
+	"reorder",
+	"grid",
+	"neighbors",
+	"density",
+	"forces",
+	"pressureSolve",
+	"velocityChange",
+	"integration",
+};
+
+const char* const t_counterNames[SphCounterCount] =
+{
+	"neighborPairs",
+	"pressureIterations",
+	"divergenceIterations",
+	"maxDensityError",
+	"substeps",
+};
+
+void RollingStatistics::add(double value)
+{
+	if (samples.size() < window)
+	{
+		samples.push_back(value);
+	}
+	else
+	{
+		samples[next] = value;
+	}
+	next = (next + 1) % window;
+}
+
+double RollingStatistics::getPercentile(double p) const
+{
+	if (samples.empty())
+		return 0;
+
+	std::vector<double> sorted(samples);
+	int k = (int)(p / 100 * (sorted.size() - 1) + 0.5);
+	std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+	return sorted[k];
+}
+
+Telemetry& Telemetry::getInstance()
+{
+	static Telemetry telemetry;
+	return telemetry;
+}
+
+Telemetry::Telemetry()
+	: origin(std::chrono::steady_clock::now())
+{
+	std::fill(framePhaseTime, framePhaseTime + SphPhaseCount, 0.0);
+	clearThreadCounters();
+	resetTotals();
+}
+
+void Telemetry::beginFrame()
+{
+	std::fill(framePhaseTime, framePhaseTime + SphPhaseCount, 0.0);
+	clearThreadCounters();
+	beginScope("step", SphPhaseCount);
+}
+
+void Telemetry::endFrame()
+{
+	assert(scopes.size() == 1);
+	double frameStart = scopes.back().start;
+	endScope();
+	frameStatistics.add((now() - frameStart) / 1000);
+
+	for (int phase = 0; phase < SphPhaseCount; phase++)
+	{
+		phaseStatistics[phase].add(framePhaseTime[phase] / 1000);
+		phaseTotal[phase] += framePhaseTime[phase] / 1000000;
+	}
+
+	// Combine the counters of the threads.
+	double counters[SphCounterCount] = {};
+	for (const ThreadCounters& thread : threadCounters)
+	{
+		counters[CounterNeighborPairs] += thread.values[CounterNeighborPairs];
+		counters[CounterPressureIterations] += thread.values[CounterPressureIterations];
+		counters[CounterDivergenceIterations] += thread.values[CounterDivergenceIterations];
+		counters[CounterMaxDensityError] = std::max(counters[CounterMaxDensityError], thread.values[CounterMaxDensityError]);
+		counters[CounterSubsteps] += thread.values[CounterSubsteps];
+	}
+	for (int counter = 0; counter < SphCounterCount; counter++)
+	{
+		counterStatistics[counter].add(counters[counter]);
+	}
+	counterTotal[CounterNeighborPairs] += counters[CounterNeighborPairs];
+	counterTotal[CounterPressureIterations] += counters[CounterPressureIterations];
+	counterTotal[CounterDivergenceIterations] += counters[CounterDivergenceIterations];
+	counterTotal[CounterMaxDensityError] = std::max(counterTotal[CounterMaxDensityError], counters[CounterMaxDensityError]);
+	counterTotal[CounterSubsteps] += counters[CounterSubsteps];
+	frameTotal++;
+
+	if (tracing && !traceEvents.empty() && traceEvents.size() < MAX_TRACE_EVENTS)
+	{
+		// The frame scope is the last event recorded.
+		TraceEvent& frame = traceEvents.back();
+		frame.frame = true;
+		std::copy(counters, counters + SphCounterCount, frame.counters);
+	}
+}
+
+void Telemetry::beginScope(const char* name, SphPhase phase)
+{
+	OpenScope scope = { name, phase, now() };
+	scopes.push_back(scope);
+}
+
+void Telemetry::endScope()
+{
+	assert(!scopes.empty());
+	const OpenScope& scope = scopes.back();
+	double end = now();
+	if (scope.phase != SphPhaseCount)
+	{
+		framePhaseTime[scope.phase] += end - scope.start;
+	}
+
+	if (tracing && traceEvents.size() < MAX_TRACE_EVENTS)
+	{
+		TraceEvent event = { scope.name, scope.start, end - scope.start, {}, false };
+		traceEvents.push_back(event);
+	}
+
+	scopes.pop_back();
+}
+
+void Telemetry::resetTotals()
+{
+	frameTotal = 0;
+	std::fill(phaseTotal, phaseTotal + SphPhaseCount, 0.0);
+	std::fill(counterTotal, counterTotal + SphCounterCount, 0.0);
+}
+
+void Telemetry::clearStatistics()
+{
+	frameStatistics.clear();
+	for (RollingStatistics& statistics : phaseStatistics)
+	{
+		statistics.clear();
+	}
+	for (RollingStatistics& statistics : counterStatistics)
+	{
+		statistics.clear();
+	}
+}
+
+bool Telemetry::startTrace(const std::string& filename)
+{
+	// Check the file can be written before recording anything.
+	std::ofstream out(filename.c_str());
+	if (!out)
+		return false;
+
+	traceFilename = filename;
+	traceEvents.clear();
+	tracing = true;
+	return true;
+}
+
+bool Telemetry::stopTrace()
+{
+	if (!tracing)
+		return false;
+
+	tracing = false;
+	std::ofstream out(traceFilename.c_str());
+	writeTrace(out);
+	traceEvents.clear();
+	return (bool)out;
+}
+
+void Telemetry::clearThreadCounters()
+{
+	int threadCount = TaskScheduler::getInstance().getThreadCount();
+	threadCounters.resize(std::max(threadCount, (int)threadCounters.size()));
+	for (ThreadCounters& thread : threadCounters)
+	{
+		std::fill(thread.values, thread.values + SphCounterCount, 0.0);
+	}
+}
+
+// Writes complete events for the scopes, which the viewer nests by time, and counter events for the frames.
+void Telemetry::writeTrace(std::ostream& out) const
+{
+	out.precision(3);
+	out.setf(std::ios::fixed);
+	out << "{\"traceEvents\":[" << std::endl;
+	for (int i = 0; i < traceEvents.size(); i++)
+	{
+		const TraceEvent& event = traceEvents[i];
+		out << (i ? "," : "") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << event.start << ",\"dur\":" << event.duration << "}" << std::endl;
+		if (event.frame)
+		{
+			out << ",{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":1,\"ts\":" << event.start << ",\"args\":{";
+			for (int counter = 0; counter < SphCounterCount; counter++)
+			{
+				out << (counter ? "," : "") << "\"" << t_counterNames[counter] << "\":" << event.counters[counter];
+			}
+			out << "}}" << std::endl;
+		}
+	}
+	out << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+}
\ No newline at end of file
@@ -1,7 +1,244 @@
 #ifndef __Telemetry_H__
 #define __Telemetry_H__
 
-extern int t_SphStepTime;
-extern int t_avgNeighbor;
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Constants.h"
+#include "TaskScheduler.h"
+
+extern double t_velocityDrift;
+extern double t_densityDrift;
+
+const int TELEMETRY_WINDOW = 120; // Frames in the rolling statistics.
+const int MAX_TRACE_EVENTS = 1000000; // Events kept in a trace, later ones are dropped.
+const char* const SPH_TRACE_FILE = "sph_trace.json"; // In the writable path of the app.
+
+// Phases of an SPH substep, in the order they run. They do not overlap, so their times add up to the substep time.
+enum SphPhase
+{
+	PhaseReorder,
+	PhaseGrid, // Grid and Verlet candidate build.
+	PhaseNeighbors,
+	PhaseDensity,
+	PhaseForces,
+	PhasePressureSolve, // Pressure iterations of PCISPH and DFSPH.
+	PhaseVelocityChange, // Includes the integration when the processor integrates the particles, see advanceSubstep().
+	PhaseIntegration, // Of the coupling to chipmunk, see SphConstraint.
+	SphPhaseCount,
+};
+
+enum SphCounter
+{
+	CounterNeighborPairs, // Summed over the substeps of a frame.
+	CounterPressureIterations, // Summed over the substeps of a frame.
+	CounterDivergenceIterations, // DFSPH, summed over the substeps of a frame.
+	CounterMaxDensityError, // Largest density error rate the pressure solver converged to in a frame.
+	CounterSubsteps, // Substeps of a frame, see SPHProcessor::chooseSubStepCount().
+	SphCounterCount,
+};
+
+extern const char* const t_phaseNames[SphPhaseCount];
+extern const char* const t_counterNames[SphCounterCount];
+
+// The samples of a value over the last frames, for percentiles that follow the recent behavior.
+class RollingStatistics
+{
+public:
+	RollingStatistics(int window = TELEMETRY_WINDOW)
+		: window(window)
+	{
+	}
+
+	void add(double value);
+
+	// p is in [0, 100]. Returns 0 without samples.
+	double getPercentile(double p) const;
+
+	double getLast() const
+	{
+		return samples.empty() ? 0 : samples[(next + samples.size() - 1) % samples.size()];
+	}
+
+	void clear()
+	{
+		samples.clear();
+		next = 0;
+	}
+
+private:
+	int window;
+	int next = 0;
+	std::vector<double> samples;
+};
+
+// Hierarchical timing and counters of the simulation. A frame is one step of the physics world. Scopes nest within
+// the frame and are timed with a monotonic clock; scopes with a phase also add to the time of the phase. Scopes are opened
+// on the simulation thread only, counters may be updated from any worker of the task scheduler, each worker has its own copy that is
+// combined when the frame ends.
+//
+// Every frame adds to the rolling statistics and to totals kept until resetTotals(). While tracing, every scope is
+// also recorded and written as a Chrome trace (chrome://tracing, or ui.perfetto.dev) when the trace stops.
+class Telemetry
+{
+public:
+	static Telemetry& getInstance();
+
+	void beginFrame();
+	void endFrame();
+
+	void beginScope(const char* name, SphPhase phase);
+	void endScope();
+
+	void addCounter(SphCounter counter, double value)
+	{
+		getThreadCounters().values[counter] += value;
+	}
+
+	void maxCounter(SphCounter counter, double value)
+	{
+		double& current = getThreadCounters().values[counter];
+		current = std::max(current, value);
+	}
+
+	const RollingStatistics& getFrameStatistics() const
+	{
+		return frameStatistics;
+	}
+
+	const RollingStatistics& getPhaseStatistics(SphPhase phase) const
+	{
+		return phaseStatistics[phase];
+	}
+
+	const RollingStatistics& getCounterStatistics(SphCounter counter) const
+	{
+		return counterStatistics[counter];
+	}
+
+	int getFrameTotal() const
+	{
+		return frameTotal;
+	}
+
+	// Seconds
+	double getPhaseTotal(SphPhase phase) const
+	{
+		return phaseTotal[phase];
+	}
+
+	double getCounterTotal(SphCounter counter) const
+	{
+		return counterTotal[counter];
+	}
+
+	void resetTotals();
+	void clearStatistics();
+
+	// Returns false if the file cannot be written. The file is written when the trace stops.
+	bool startTrace(const std::string& filename);
+	bool stopTrace();
+
+	bool isTracing() const
+	{
+		return tracing;
+	}
+
+private:
+	struct OpenScope
+	{
+		const char* name;
+		SphPhase phase;
+		double start;
+	};
+
+	struct TraceEvent
+	{
+		const char* name;
+		double start, duration; // Microseconds
+		double counters[SphCounterCount]; // Of the frame, for the events of frames.
+		bool frame;
+	};
+
+	// Padded to a cache line of its own, so threads never write to the same line.
+	struct ThreadCounters
+	{
+		double values[SphCounterCount];
+		char padding[64];
+	};
+
+	std::chrono::steady_clock::time_point origin;
+	std::vector<OpenScope> scopes;
+	std::vector<ThreadCounters> threadCounters;
+	double framePhaseTime[SphPhaseCount];
+	RollingStatistics frameStatistics;
+	RollingStatistics phaseStatistics[SphPhaseCount];
+	RollingStatistics counterStatistics[SphCounterCount];
+	int frameTotal;
+	double phaseTotal[SphPhaseCount];
+	double counterTotal[SphCounterCount];
+	bool tracing = false;
+	std::string traceFilename;
+	std::vector<TraceEvent> traceEvents;
+
+	Telemetry();
+
+	// Microseconds since the telemetry was created.
+	double now() const
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	ThreadCounters& getThreadCounters()
+	{
+		int thread = TaskScheduler::getWorkerIndex();
+		assert(thread < threadCounters.size());
+		return threadCounters[thread];
+	}
+
+	void clearThreadCounters();
+	void writeTrace(std::ostream& out) const;
+};
+
+// Times the enclosing block, see Telemetry.
+class TelemetryScope
+{
+public:
+	TelemetryScope(const char* name, SphPhase phase = SphPhaseCount)
+	{
+		Telemetry::getInstance().beginScope(name, phase);
+	}
+
+	~TelemetryScope()
+	{
+		Telemetry::getInstance().endScope();
+	}
+};
+
+class PhaseTimer : public TelemetryScope
+{
+public:
+	PhaseTimer(SphPhase phase)
+		: TelemetryScope(t_phaseNames[phase], phase)
+	{
+	}
+};
+
+// Times the enclosing block as a frame of the telemetry.
+class TelemetryFrame
+{
+public:
+	TelemetryFrame()
+	{
+		Telemetry::getInstance().beginFrame();
+	}
+
+	~TelemetryFrame()
+	{
+		Telemetry::getInstance().endFrame();
+	}
+};
 
 #endif // __Telemetry_H__
\ No newline at end of file
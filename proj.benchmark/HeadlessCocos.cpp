@@ -0,0 +1,28 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include "base/ccMacros.h"
+
+// The headless builds link the cocos math sources without the rest of cocos. In debug builds their CCASSERTs call into
+// the console and script support of cocos, so these stand in for them: there is no script engine to handle an assert,
+// and log messages go to stderr.
+
+#if COCOS2D_DEBUG > 0 && CC_ENABLE_SCRIPT_BINDING
+bool cc_assert_script_compatible(const char *msg)
+{
+	return false;
+}
+#endif
+
+NS_CC_BEGIN
+
+void log(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "cocos2d: ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+NS_CC_END
\ No newline at end of file
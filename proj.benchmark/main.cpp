@@ -0,0 +1,156 @@
+#include "../Classes/SphBenchmark.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+USING_NS_CC;
+
+// Headless SPH benchmark. Runs the canonical scenarios at several sizes and thread counts, prints a table and writes the
+// results as json.
+//
+// Options, lists are comma separated:
+//   --scenarios damBreak,restingTank,dropletImpact
+//   --particles 1000,10000,100000
+//   --threads 1,2,4 (default: powers of two up to the core count)
+//   --steps 50 --warmup 10 (frames of 1/60 s)
+//   --parameters SphParameters.json
+//   --output sph_benchmark.json
+//   --trace sph_trace.json (Chrome trace of all runs)
+
+static std::vector<std::string> split(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		items.push_back(item);
+	}
+	return items;
+}
+
+static std::vector<int> parseInts(const std::string& list)
+{
+	std::vector<int> values;
+	for (const std::string& item : split(list))
+	{
+		values.push_back(atoi(item.c_str()));
+	}
+	return values;
+}
+
+static bool parseScenarios(const std::string& list, std::vector<SphScenario>& scenarios)
+{
+	scenarios.clear();
+	for (const std::string& item : split(list))
+	{
+		int scenario = 0;
+		while (scenario < SphScenarioCount && item != SPH_SCENARIO_NAMES[scenario])
+			scenario++;
+		if (scenario == SphScenarioCount)
+			return false;
+		scenarios.push_back((SphScenario)scenario);
+	}
+	return true;
+}
+
+static bool readFile(const std::string& filename, std::string& text)
+{
+	std::ifstream in(filename.c_str());
+	if (!in)
+		return false;
+
+	std::stringstream ss;
+	ss << in.rdbuf();
+	text = ss.str();
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<SphScenario> scenarios = { DamBreak, RestingTank, DropletImpact };
+	std::vector<int> particleCounts = { 1000, 10000, 100000 };
+	std::vector<int> threadCounts;
+	int stepCount = 50;
+	int warmupStepCount = 10;
+	std::string output = "sph_benchmark.json";
+	std::string trace;
+	SphParameters params;
+
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string option = argv[i];
+		std::string value = argv[i + 1];
+		if (option == "--scenarios")
+		{
+			if (!parseScenarios(value, scenarios))
+			{
+				fprintf(stderr, "Unknown scenario in %s\n", value.c_str());
+				return 1;
+			}
+		}
+		else if (option == "--particles")
+			particleCounts = parseInts(value);
+		else if (option == "--threads")
+			threadCounts = parseInts(value);
+		else if (option == "--steps")
+			stepCount = atoi(value.c_str());
+		else if (option == "--warmup")
+			warmupStepCount = atoi(value.c_str());
+		else if (option == "--output")
+			output = value;
+		else if (option == "--trace")
+			trace = value;
+		else if (option == "--parameters")
+		{
+			std::string text;
+			if (!readFile(value, text) || !params.loadJson(text))
+			{
+				fprintf(stderr, "Cannot read parameters from %s\n", value.c_str());
+				return 1;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", option.c_str());
+			return 1;
+		}
+	}
+
+	if (threadCounts.empty())
+	{
+		int coreCount = std::max((int)std::thread::hardware_concurrency(), 1);
+		for (int threadCount = 1; threadCount < coreCount; threadCount *= 2)
+		{
+			threadCounts.push_back(threadCount);
+		}
+		threadCounts.push_back(coreCount);
+	}
+
+	if (!trace.empty() && !Telemetry::getInstance().startTrace(trace))
+	{
+		fprintf(stderr, "Cannot write %s\n", trace.c_str());
+		return 1;
+	}
+
+	SphBenchmark benchmark(params, stepCount, warmupStepCount);
+	std::vector<SphBenchmarkResult> results = benchmark.run(scenarios, particleCounts, threadCounts);
+	Telemetry::getInstance().stopTrace();
+	benchmark.writeTable(std::cout, results);
+
+	std::ofstream out(output.c_str());
+	benchmark.writeJson(out, results);
+	if (!out)
+	{
+		fprintf(stderr, "Cannot write %s\n", output.c_str());
+		return 1;
+	}
+
+	return 0;
+}
\ No newline at end of file